@@ -16,7 +16,10 @@
 #include "weavesketch.hpp"
 #include "elastic.hpp"
 #include "spacesaving.hpp"
+#include "delta.hpp"
+#include "hierarchical.hpp"
 #include "load_dataset.hpp"
+#include "perf.hpp"
 using namespace std;
 
 
@@ -33,14 +36,23 @@ map<ID_TYPE, int> get_ground_truth(vector<pair<ID_TYPE, TS_TYPE>> dataset) {
 }
 
 template<typename ID_TYPE>
-void get_error(Sketch<ID_TYPE>* sketch, map<ID_TYPE, int> ground_truth, int max_error, double insert_throughput) {
+void get_error(Sketch<ID_TYPE>* sketch, map<ID_TYPE, int> ground_truth, int max_error, double insert_throughput, const PerfCounters* insert_perf = NULL, uint64_t insert_num = 0) {
+	// with insert_perf set, the query loop is profiled too and both are reported per operation
 	double aae = 0, are = 0;
 	double outliers = 0;
+	// perf_event fds are opened only when profiling
+	PerfCounters* query_perf = insert_perf ? new PerfCounters() : NULL;
+	if (query_perf) {
+		query_perf->start();
+	}
 	auto start_time = std::chrono::high_resolution_clock::now();
 	for (auto &p : ground_truth) {
         int result = sketch->query(p.first);
 	}
 	auto end_time = std::chrono::high_resolution_clock::now();
+	if (query_perf) {
+		query_perf->stop();
+	}
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
 	double elapsed_time = duration.count() / 1000.0;
 	double query_throughput = ground_truth.size() / elapsed_time / 1e6;
@@ -55,6 +67,11 @@ void get_error(Sketch<ID_TYPE>* sketch, map<ID_TYPE, int> ground_truth, int max_
 	aae /= ground_truth.size();
     are /= ground_truth.size();
 	std::cout << aae << " " << are << " " << outliers << " " << insert_throughput << " " << query_throughput << "\n";;
+	if (insert_perf) {
+		insert_perf->print("insert", insert_num);
+		query_perf->print("query", ground_truth.size());
+		delete query_perf;
+	}
 }
 
 
@@ -79,9 +96,34 @@ void get_heavy_error(Sketch<ID_TYPE>* sketch, map<ID_TYPE, int> ground_truth, in
 
 
 
+// AAE, ARE and insert Mops of WeaveSketch with DATA_TYPE light counters at memory KB
+template<typename DATA_TYPE, typename ID_TYPE, typename TS_TYPE>
+void print_light_counters(const vector<std::pair<ID_TYPE, TS_TYPE>>& dataset, const map<ID_TYPE, int>& ground_truth, int memory, int max_error) {
+	WeaveSketch<ID_TYPE, DATA_TYPE> weavesketch(memory, 3, 3, max_error, 0.8);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (auto &p : dataset) {
+		weavesketch.insert(p.first, 1);
+	}
+	double elapsed_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+	double are = 0, aae = 0;
+	for (auto &p : ground_truth) {
+		double error = fabs(p.second - weavesketch.query(p.first));
+		are += error / p.second;
+		aae += error;
+	}
+	std::cout << " " << aae / ground_truth.size() << " " << are / ground_truth.size() << " " << dataset.size() / elapsed_time / 1e6;
+}
+
 template<typename ID_TYPE, typename TS_TYPE>
-void run(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth) {
+void run(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth, bool profile = false) {
+	// profile: read hardware counters around the insert and query loops
+	// per memory, the get_error() row, then "counters", memory, and AAE, ARE, insert Mops
+	// of WeaveSketch with int8_t, int32_t and PackedCounter<4> light counters
 	int max_error = 14;
+	PerfCounters* perf = profile ? new PerfCounters() : NULL;
+	if (perf && !perf->available()) {
+		std::cout << "perf_event unavailable, hardware counters reported as n/a\n";
+	}
 	for (int memory = 100; memory <= 2000; memory += 100) {
 		int depth = 3;
 		Sketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
@@ -92,6 +134,9 @@ void run(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_t
 		Sketch<ID_TYPE>* spacesaving = new SpaceSaving<ID_TYPE>(memory);
 		Sketch<ID_TYPE>* uss = new UnbiasedSpaceSaving<ID_TYPE>(memory);
 		Sketch<ID_TYPE>* coco = new CocoSketch<ID_TYPE>(memory, depth);
+		if (perf) {
+			perf->start();
+		}
 		auto start_time = std::chrono::high_resolution_clock::now();
 		for (auto &p : dataset) {
 			ID_TYPE key = p.first;
@@ -105,21 +150,557 @@ void run(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_t
 			// coco->insert(key, 1);
 		}
 		auto end_time = std::chrono::high_resolution_clock::now();
+		if (perf) {
+			perf->stop();
+		}
 		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
 		double elapsed_time = duration.count() / 1000.0;
 		double insert_throughput = dataset.size() / elapsed_time / 1e6;
 
 		// std::cout << memory << " ";
-		get_error(weavesketch, ground_truth, max_error, insert_throughput);
-		// get_error(cmsketch, ground_truth, max_error, insert_throughput);
-		// get_error(cusketch, ground_truth, max_error, insert_throughput);
-		// get_error(countsketch, ground_truth, max_error, insert_throughput);
-		// get_error(elasticsketch, ground_truth, max_error, insert_throughput);
-		// get_error(spacesaving, ground_truth, max_error, insert_throughput);	
-		// get_error(uss, ground_truth, max_error, insert_throughput);
-		// get_error(coco, ground_truth, max_error, insert_throughput);
+		const PerfCounters* insert_perf = perf;
+		get_error(weavesketch, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(cmsketch, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(cusketch, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(countsketch, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(elasticsketch, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(spacesaving, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());	
+		// get_error(uss, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
+		// get_error(coco, ground_truth, max_error, insert_throughput, insert_perf, dataset.size());
 		// std::cout << "\n";
+		std::cout << "counters " << memory;
+		print_light_counters<int8_t>(dataset, ground_truth, memory, max_error);
+		print_light_counters<int32_t>(dataset, ground_truth, memory, max_error);
+		print_light_counters<PackedCounter<4>>(dataset, ground_truth, memory, max_error);
+		std::cout << "\n";
+	}
+	delete perf;
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_front_cache(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth, const char* trace) {
+	// trace, memory, cache hit rate, throughput without / with cache, gain; then the cached sketch's error line
+	int max_error = 14;
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		WeaveSketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+		WeaveSketch<ID_TYPE>* cached = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+		cached->enable_front_cache(1024);
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (auto &p : dataset) {
+			weavesketch->insert(p.first, 1);
+		}
+		auto end_time = std::chrono::high_resolution_clock::now();
+		double base_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		start_time = std::chrono::high_resolution_clock::now();
+		for (auto &p : dataset) {
+			cached->insert(p.first, 1);
+		}
+		cached->flush();
+		end_time = std::chrono::high_resolution_clock::now();
+		double cache_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		std::cout << trace << " " << memory << " " << cached->cache_hit_rate() << " " << base_throughput << " " << cache_throughput << " " << cache_throughput / base_throughput << "\n";
+		get_error(cached, ground_truth, max_error, cache_throughput);
+		delete weavesketch;
+		delete cached;
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_pipeline(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth, bool profile = false) {
+	// memory, sequential / pipelined insert throughput; then the pipelined sketch's error line
+	// profile: hardware counters per insert of each, the pipelined one over both threads
+	int max_error = 14;
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		WeaveSketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+		PerfCounters* base_perf = profile ? new PerfCounters() : NULL;
+		if (base_perf) {
+			base_perf->start();
+		}
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (auto &p : dataset) {
+			weavesketch->insert(p.first, 1);
+		}
+		auto end_time = std::chrono::high_resolution_clock::now();
+		if (base_perf) {
+			base_perf->stop();
+		}
+		double base_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		// opened before the light thread starts, so that it inherits them
+		PerfCounters* pipeline_perf = profile ? new PerfCounters() : NULL;
+		WeaveSketch<ID_TYPE>* pipelined = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+		pipelined->enable_pipeline();
+		if (pipeline_perf) {
+			pipeline_perf->start();
+		}
+		start_time = std::chrono::high_resolution_clock::now();
+		for (auto &p : dataset) {
+			pipelined->insert(p.first, 1);
+		}
+		pipelined->sync();
+		end_time = std::chrono::high_resolution_clock::now();
+		if (pipeline_perf) {
+			pipeline_perf->stop();
+		}
+		double pipeline_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		std::cout << memory << " " << base_throughput << " " << pipeline_throughput << "\n";
+		if (profile) {
+			base_perf->print("sequential", dataset.size());
+			pipeline_perf->print("pipelined", dataset.size());
+		}
+		get_error(pipelined, ground_truth, max_error, pipeline_throughput);
+		delete weavesketch;
+		delete pipelined;
+		delete base_perf;
+		delete pipeline_perf;
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_huge_pages(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth) {
+	// memory, huge pages on/off, insert throughput, dTLB misses per insert; then the error line
+	int max_error = 14;
+	const int memory_list[] = {100, 500, 2000, 8000, 32000};
+	for (int memory : memory_list) {
+		for (int huge_pages = 0; huge_pages < 2; ++huge_pages) {
+			memory_policy().huge_pages = huge_pages;
+			WeaveSketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+			PerfCounters perf;
+			perf.start();
+			auto start_time = std::chrono::high_resolution_clock::now();
+			for (auto &p : dataset) {
+				weavesketch->insert(p.first, 1);
+			}
+			auto end_time = std::chrono::high_resolution_clock::now();
+			perf.stop();
+			double insert_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+			double tlb_miss = perf.get(PERF_DTLB_MISS);
+			std::cout << memory << " " << huge_pages << " " << insert_throughput << " ";
+			if (tlb_miss < 0) {
+				std::cout << "n/a\n";
+			}
+			else {
+				std::cout << tlb_miss / dataset.size() << "\n";
+			}
+			get_error(weavesketch, ground_truth, max_error, insert_throughput);
+			delete weavesketch;
+		}
+	}
+	memory_policy().huge_pages = true;
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_invertible(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth) {
+	// memory, reported heavy hitters, precision, recall without / with the invertible table (a quarter of memory on top)
+	int max_error = 14, threshold = 1000;
+	int heavy_flow = 0;
+	for (auto &p : ground_truth) {
+		heavy_flow += p.second >= threshold;
+	}
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		std::cout << memory;
+		for (int enabled = 0; enabled < 2; ++enabled) {
+			WeaveSketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, 0.8);
+			if (enabled) {
+				weavesketch->enable_invertible(memory / 4);
+			}
+			for (auto &p : dataset) {
+				weavesketch->insert(p.first, 1);
+			}
+			auto heavy_hitters = weavesketch->heavy_hitters(threshold);
+			int correct = 0;
+			for (auto &item : heavy_hitters) {
+				auto it = ground_truth.find(item.first);
+				correct += it != ground_truth.end() && it->second >= threshold;
+			}
+			std::cout << " " << heavy_hitters.size() << " " << (heavy_hitters.empty() ? 1.0 : 1.0 * correct / heavy_hitters.size()) << " " << (heavy_flow ? 1.0 * correct / heavy_flow : 1.0);
+			delete weavesketch;
+		}
+		std::cout << "\n";
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_heavy_change(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, int epoch_num = 10, int threshold = 500) {
+	// dataset carries absolute timestamps (loadCAIDATimed); it is cut into epoch_num
+	// equal time spans and each consecutive pair is compared.
+	// memory, epoch, true changes, reported, precision, recall, F1, diff time / query-all-keys time (ms)
+	int max_error = 14;
+	if (dataset.empty()) {
+		return;
+	}
+	TS_TYPE begin_time = dataset.front().second, span = (dataset.back().second - begin_time) / epoch_num + 1;
+	vector<vector<ID_TYPE>> epoch(epoch_num);
+	for (auto &p : dataset) {
+		epoch[(p.second - begin_time) / span].push_back(p.first);
+	}
+	for (int memory = 500; memory <= 2000; memory += 500) {
+		for (int e = 1; e < epoch_num; ++e) {
+			WeaveSketch<ID_TYPE> before(memory, 3, 3, max_error, 0.8), after(memory, 3, 3, max_error, 0.8);
+			map<ID_TYPE, int> before_truth, after_truth;
+			for (auto &key : epoch[e - 1]) {
+				before.insert(key, 1);
+				before_truth[key]++;
+			}
+			for (auto &key : epoch[e]) {
+				after.insert(key, 1);
+				after_truth[key]++;
+			}
+			map<ID_TYPE, int> change = after_truth;
+			for (auto &p : before_truth) {
+				change[p.first] -= p.second;
+			}
+			int true_change = 0;
+			for (auto &p : change) {
+				true_change += abs(p.second) >= threshold;
+			}
+
+			auto start_time = std::chrono::high_resolution_clock::now();
+			auto reported = before.heavy_changes(after, threshold);
+			auto end_time = std::chrono::high_resolution_clock::now();
+			double diff_time = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+			// the alternative: query every key seen in either epoch in both sketches
+			start_time = std::chrono::high_resolution_clock::now();
+			int naive = 0;
+			for (auto &p : change) {
+				naive += abs(after.query(p.first) - before.query(p.first)) >= threshold;
+			}
+			end_time = std::chrono::high_resolution_clock::now();
+			double naive_time = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+			int correct = 0;
+			for (auto &item : reported) {
+				correct += abs(change[item.key]) >= threshold;
+			}
+			double precision = reported.empty() ? 1.0 : 1.0 * correct / reported.size();
+			double recall = true_change ? 1.0 * correct / true_change : 1.0;
+			double f1 = precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0;
+			std::cout << memory << " " << e << " " << true_change << " " << reported.size() << " " << precision << " " << recall << " " << f1 << " " << diff_time << " " << naive_time << "\n";
+		}
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_adaptive(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth) {
+	// memory, memory_ratio (or "adaptive" and the final heavy share); then that sketch's error line
+	int max_error = 14;
+	const double ratio_list[] = {0.5, 0.6, 0.7, 0.8, 0.9};
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		for (int k = 0; k <= 5; ++k) {
+			bool adaptive = k == 5;
+			WeaveSketch<ID_TYPE>* weavesketch = new WeaveSketch<ID_TYPE>(memory, 3, 3, max_error, adaptive ? 0.8 : ratio_list[k]);
+			if (adaptive) {
+				weavesketch->enable_adaptive();
+			}
+			auto start_time = std::chrono::high_resolution_clock::now();
+			for (auto &p : dataset) {
+				weavesketch->insert(p.first, 1);
+			}
+			auto end_time = std::chrono::high_resolution_clock::now();
+			double insert_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+			std::cout << memory << " ";
+			if (adaptive) {
+				std::cout << "adaptive " << weavesketch->heavy_ratio() << "\n";
+			}
+			else {
+				std::cout << ratio_list[k] << "\n";
+			}
+			get_error(weavesketch, ground_truth, max_error, insert_throughput);
+			delete weavesketch;
+		}
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_hierarchical(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, int threshold = 10000) {
+	// memory, hierarchical Mpps, independent Mpps, HHHs; then per level: length, AAE hierarchical, AAE independent
+	// (source address: the first four bytes of the key, as in the CAIDA records)
+	int max_error = 14;
+	const vector<int> lengths = {16, 24, 32};
+	int levels = lengths.size();
+	vector<uint32_t> addresses(dataset.size());
+	for (size_t i = 0; i < dataset.size(); ++i) {
+		uint32_t src;
+		memcpy(&src, &dataset[i].first, sizeof(src));
+		addresses[i] = __builtin_bswap32(src);
+	}
+	vector<map<uint32_t, int>> ground_truth(levels);
+	for (uint32_t address : addresses) {
+		for (int l = 0; l < levels; ++l) {
+			ground_truth[l][address & ~0u << (32 - lengths[l])]++;
+		}
+	}
+	for (int memory = 300; memory <= 3000; memory += 300) {
+		HierarchicalWeaveSketch<> hierarchical(lengths, memory, 3, 3, max_error, 0.8);
+		auto start_time = std::chrono::high_resolution_clock::now();
+		hierarchical.insert_batch(addresses.data(), addresses.size());
+		auto end_time = std::chrono::high_resolution_clock::now();
+		double hierarchical_throughput = addresses.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		// one sketch per level keyed by (length, prefix), since prefix 0 alone would be the empty key
+		vector<WeaveSketch<uint64_t>*> independent;
+		for (int l = 0; l < levels; ++l) {
+			independent.push_back(new WeaveSketch<uint64_t>(memory / levels, 3, 3, max_error, 0.8));
+		}
+		start_time = std::chrono::high_resolution_clock::now();
+		for (uint32_t address : addresses) {
+			for (int l = 0; l < levels; ++l) {
+				independent[l]->insert((uint64_t)lengths[l] << 32 | (address & ~0u << (32 - lengths[l])), 1);
+			}
+		}
+		end_time = std::chrono::high_resolution_clock::now();
+		double independent_throughput = addresses.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+		std::cout << memory << " " << hierarchical_throughput << " " << independent_throughput << " " << hierarchical.hierarchical_heavy_hitters(threshold).size();
+		for (int l = 0; l < levels; ++l) {
+			double hierarchical_aae = 0, independent_aae = 0;
+			for (auto &p : ground_truth[l]) {
+				hierarchical_aae += abs(hierarchical.query(p.first, l) - p.second);
+				independent_aae += abs(independent[l]->query((uint64_t)lengths[l] << 32 | p.first) - p.second);
+			}
+			std::cout << " " << lengths[l] << " " << hierarchical_aae / ground_truth[l].size() << " " << independent_aae / ground_truth[l].size();
+			delete independent[l];
+		}
+		std::cout << "\n";
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_metrics(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth) {
+	// memory, frequency-only Mops, with cardinality Mops, true and estimated cardinality, true and estimated entropy
+	int max_error = 14;
+	double true_entropy = log2((double)dataset.size());
+	for (auto &p : ground_truth) {
+		true_entropy -= p.second * log2((double)p.second) / dataset.size();
+	}
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		double throughput[2];
+		double cardinality = 0, entropy = 0;
+		for (int k = 0; k < 2; ++k) {
+			WeaveSketch<ID_TYPE> weavesketch(memory, 3, 3, max_error, 0.8);
+			if (k) {
+				weavesketch.enable_cardinality();
+			}
+			auto start_time = std::chrono::high_resolution_clock::now();
+			for (auto &p : dataset) {
+				weavesketch.insert(p.first, 1);
+			}
+			auto end_time = std::chrono::high_resolution_clock::now();
+			throughput[k] = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+			if (k) {
+				cardinality = weavesketch.cardinality();
+				entropy = weavesketch.entropy();
+			}
+		}
+		std::cout << memory << " " << throughput[0] << " " << throughput[1] << " " << ground_truth.size() << " " << cardinality << " " << true_entropy << " " << entropy << "\n";
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_delta(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, int epoch_num = 10) {
+	// memory, epoch, snapshot bytes, frame bytes, compression ratio, encode GB/s, decode GB/s, mismatched queries
+	// (GB/s of snapshot image; encode and decode exclude taking and loading the snapshot)
+	int max_error = 14;
+	size_t epoch_length = dataset.size() / epoch_num;
+	for (int memory = 500; memory <= 2000; memory *= 2) {
+		WeaveSketch<ID_TYPE> sender(memory, 3, 3, max_error, 0.8), receiver;
+		DeltaEncoder encoder;
+		DeltaDecoder decoder;
+		vector<char> image;
+		vector<uint8_t> frame;
+		for (int e = 0; e < epoch_num; ++e) {
+			for (size_t i = e * epoch_length; i < (e + 1) * epoch_length; ++i) {
+				sender.insert(dataset[i].first, 1);
+			}
+			DeltaEncoder::image(sender, image);
+			size_t image_bytes = image.size();
+			auto start_time = std::chrono::high_resolution_clock::now();
+			encoder.encode_image(image, frame);
+			auto end_time = std::chrono::high_resolution_clock::now();
+			double encode_time = std::chrono::duration<double>(end_time - start_time).count();
+			start_time = std::chrono::high_resolution_clock::now();
+			bool ok = decoder.apply_image(frame.data(), frame.size());
+			end_time = std::chrono::high_resolution_clock::now();
+			double decode_time = std::chrono::duration<double>(end_time - start_time).count();
+
+			SnapshotReader reader(decoder.image.data(), decoder.image.size());
+			std::istream in(&reader);
+			int mismatches = ok && receiver.load(in) ? 0 : -1;
+			for (size_t i = 0; i < (e + 1) * epoch_length && mismatches >= 0; i += 97) {
+				mismatches += sender.query(dataset[i].first) != receiver.query(dataset[i].first);
+			}
+			std::cout << memory << " " << e << " " << image_bytes << " " << frame.size() << " " << 1.0 * image_bytes / frame.size() << " "
+				<< image_bytes / encode_time / 1e9 << " " << image_bytes / decode_time / 1e9 << " " << mismatches << "\n";
+		}
+	}
+}
+
+// Replays the trace at load times the rate a plain sketch sustains, through
+// a queue of queue_size packets in front of the sketch; packets that arrive
+// at a full queue overwrite the oldest ones, as a capture ring does.
+template<typename ID_TYPE, typename TS_TYPE>
+void run_overload(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth, int memory = 1000, uint64_t queue_size = 1 << 16) {
+	// load, overload mode, offered Mpps, handled Mpps, dropped share, final and coarsest sampling level,
+	// ARE, AAE, share of keys whose count lies in query_interval(), light expansions,
+	// ARE and AAE over the keys outside the heavy part
+	int max_error = 14;
+	size_t n = dataset.size();
+	double capacity;
+	{
+		WeaveSketch<ID_TYPE> weavesketch(memory, 3, 3, max_error, 0.8);
+		auto start_time = std::chrono::steady_clock::now();
+		for (auto &p : dataset) {
+			weavesketch.insert(p.first, 1);
+		}
+		capacity = n / std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+	const double load_list[] = {1, 1.5, 2, 4, 8};
+	for (double load: load_list) {
+		for (int overload = 0; overload < 2; ++overload) {
+			WeaveSketch<ID_TYPE> weavesketch(memory, 3, 3, max_error, 0.8);
+			if (overload) {
+				weavesketch.enable_overload(queue_size / 4);
+			}
+			double rate = load * capacity;
+			size_t next = 0, dropped = 0;
+			auto start_time = std::chrono::steady_clock::now();
+			while (next < n) {
+				double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+				size_t arrived = (size_t)(now * rate);
+				arrived = MIN(arrived, n);
+				if (arrived - next > queue_size) {
+					dropped += arrived - queue_size - next;
+					next = arrived - queue_size;
+				}
+				weavesketch.report_backlog(arrived - next);
+				size_t end = MIN(arrived, next + 64);
+				for (; next < end; ++next) {
+					weavesketch.insert(dataset[next].first, 1);
+				}
+			}
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+			map<ID_TYPE, int> heavy;
+			weavesketch.for_each_heavy([&](const ID_TYPE& key, int32_t estimate) {
+				heavy[key] = estimate;
+			});
+			double are = 0, aae = 0, light_are = 0, light_aae = 0;
+			size_t covered = 0, light_keys = 0;
+			for (auto &p : ground_truth) {
+				QueryInterval interval = weavesketch.query_interval(p.first);
+				double error = abs(interval.estimate - p.second);
+				are += error / p.second;
+				aae += error;
+				covered += interval.lower <= p.second && p.second <= interval.upper;
+				if (!heavy.count(p.first)) {
+					light_are += error / p.second;
+					light_aae += error;
+					light_keys++;
+				}
+			}
+			light_keys = MAX(light_keys, (size_t)1);
+			WeaveSketchStats stats = weavesketch.stats();
+			std::cout << load << " " << overload << " " << rate / 1e6 << " " << (n - dropped) / elapsed / 1e6 << " " << 1.0 * dropped / n << " "
+				<< stats.sampling_level << " " << stats.max_sampling_level << " " << are / ground_truth.size() << " " << aae / ground_truth.size() << " "
+				<< 1.0 * covered / ground_truth.size() << " " << stats.light_expansions << " " << light_are / light_keys << " " << light_aae / light_keys << "\n";
+		}
+	}
+}
+
+template<typename ID_TYPE, typename TS_TYPE>
+void run_relocation(vector<std::pair<ID_TYPE, TS_TYPE>> dataset, map<ID_TYPE, int> ground_truth, int reference_memory = 2000) {
+	// memory, relocation hops (0: evict at once), Mops, ARE, AAE, heavy and light expansions, evictions,
+	// heavy occupancy, relocations by hops (1..RELOCATION_MAX_HOPS), failed searches;
+	// then per hops setting, the least memory whose AAE is at most that of hops 0 at reference_memory
+	int max_error = 14;
+	vector<vector<pair<int, double>>> aae_list(RELOCATION_MAX_HOPS + 1);
+	for (int memory = 100; memory <= 2000; memory += 100) {
+		for (int hops = 0; hops <= RELOCATION_MAX_HOPS; ++hops) {
+			WeaveSketch<ID_TYPE> weavesketch(memory, 3, 3, max_error, 0.8);
+			weavesketch.enable_relocation(hops);
+			auto start_time = std::chrono::high_resolution_clock::now();
+			for (auto &p : dataset) {
+				weavesketch.insert(p.first, 1);
+			}
+			auto end_time = std::chrono::high_resolution_clock::now();
+			double insert_throughput = dataset.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+			double are = 0, aae = 0;
+			for (auto &p : ground_truth) {
+				int error = abs(weavesketch.query(p.first) - p.second);
+				are += 1.0 * error / p.second;
+				aae += error;
+			}
+			are /= ground_truth.size();
+			aae /= ground_truth.size();
+			aae_list[hops].push_back(make_pair(memory, aae));
+			WeaveSketchStats stats = weavesketch.stats();
+			std::cout << memory << " " << hops << " " << insert_throughput << " " << are << " " << aae << " " << stats.heavy_expansions << " "
+				<< stats.light_expansions << " " << stats.evictions << " " << stats.heavy_occupancy;
+			for (int k = 0; k < RELOCATION_MAX_HOPS; ++k) {
+				std::cout << " " << stats.relocations[k];
+			}
+			std::cout << " " << stats.relocation_failures << "\n";
+		}
+	}
+	double target = -1;
+	for (auto &item : aae_list[0]) {
+		if (item.first == reference_memory) {
+			target = item.second;
+		}
+	}
+	for (int hops = 0; hops <= RELOCATION_MAX_HOPS; ++hops) {
+		int least = -1;
+		for (auto &item : aae_list[hops]) {
+			if (item.second <= target && least < 0) {
+				least = item.first;
+			}
+		}
+		std::cout << "equal accuracy " << hops << " " << least << "\n";
+	}
+}
+
+template<typename ID_TYPE>
+void run_pcap(const char* filename, int batch = 256) {
+	// packets, parse-only Mpps, sketch-only Mops, parse + sketch Mpps
+	PcapReader reader(filename);
+	if (!reader.ok()) {
+		printf("%s not found!\n", filename);
+		return;
+	}
+	int max_error = 14;
+	vector<ID_TYPE> keys(batch);
+	vector<uint64_t> ts(batch);
+	vector<ID_TYPE> parsed;
+	int n;
+	auto start_time = std::chrono::high_resolution_clock::now();
+	while ((n = reader.next_batch(keys.data(), ts.data(), batch)) > 0) {
+		parsed.insert(parsed.end(), keys.begin(), keys.begin() + n);
+	}
+	auto end_time = std::chrono::high_resolution_clock::now();
+	uint64_t packets = reader.packet_count();
+	double parse_throughput = packets / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+	WeaveSketch<ID_TYPE> sketch_only(1000, 3, 3, max_error, 0.8), combined(1000, 3, 3, max_error, 0.8);
+	start_time = std::chrono::high_resolution_clock::now();
+	for (auto &key : parsed) {
+		sketch_only.insert(key, 1);
+	}
+	end_time = std::chrono::high_resolution_clock::now();
+	double sketch_throughput = parsed.size() / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+
+	reader.rewind();
+	start_time = std::chrono::high_resolution_clock::now();
+	while ((n = reader.next_batch(keys.data(), ts.data(), batch)) > 0) {
+		for (int i = 0; i < n; ++i) {
+			combined.insert(keys[i], 1);
+		}
 	}
+	end_time = std::chrono::high_resolution_clock::now();
+	double combined_throughput = packets / std::chrono::duration<double>(end_time - start_time).count() / 1e6;
+	std::cout << packets << " " << parse_throughput << " " << sketch_throughput << " " << combined_throughput << "\n";
 }
 
 
@@ -0,0 +1,353 @@
+#ifndef COUNTER_H_
+#define COUNTER_H_
+
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+#include "memory.hpp"
+
+// Counter policies for the counter-based sketches. A policy owns one row of
+// w counters and exposes get/add/set plus a bulk load used for scans.
+
+
+// One DATA_TYPE per counter; behaves exactly like a raw DATA_TYPE array.
+template<typename DATA_TYPE>
+class PlainCounter {
+public:
+	PlainCounter(): w(0), counter(NULL) {}
+	~PlainCounter() {
+		huge_free(counter, w);
+	}
+	PlainCounter(const PlainCounter&) = delete;
+	PlainCounter& operator=(const PlainCounter&) = delete;
+
+	static uint32_t width(int memory, int d) {
+		return memory * 1024 / sizeof(DATA_TYPE) / d;
+	}
+
+	// bytes of a row of w counters
+	static uint64_t row_bytes(uint32_t w) {
+		return (uint64_t)w * sizeof(DATA_TYPE);
+	}
+
+	// largest value a counter holds before it wraps
+	static int32_t limit() {
+		return (int64_t)std::numeric_limits<DATA_TYPE>::max() < INT32_MAX ? (int32_t)std::numeric_limits<DATA_TYPE>::max() : INT32_MAX;
+	}
+
+	void init(uint32_t _w) {
+		w = _w;
+		counter = huge_alloc<DATA_TYPE>(w);
+	}
+
+	int32_t get(uint32_t index) const {
+		return counter[index];
+	}
+
+	void add(uint32_t index, int32_t value) {
+		counter[index] += value;
+	}
+
+	void set(uint32_t index, int32_t value) {
+		counter[index] = value;
+	}
+
+	void load(uint32_t begin, uint32_t n, int32_t* out) const {
+		const DATA_TYPE* src = counter + begin;
+		for (uint32_t k = 0; k < n; ++k) {
+			out[k] = src[k];
+		}
+	}
+
+	double calculate_memory() const {
+		return w * sizeof(DATA_TYPE) / 1024.0;
+	}
+
+private:
+	uint32_t w;
+	DATA_TYPE* counter;
+};
+
+
+// Full values of the overflowed counters of one PackedCounter row: a flat
+// open-addressed table (linear probing) from counter index to value. Erase
+// shifts the following entries back, so there are no tombstones.
+class OverflowTable {
+public:
+	OverflowTable(): count(0), bits(0) {}
+
+	void clear() {
+		slot.clear();
+		count = bits = 0;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return !count;
+	}
+
+	// value of an index that is in the table
+	int32_t find(uint32_t index) const {
+		uint32_t mask = slot.size() - 1, i = home(index);
+		while (slot[i].index != index) {
+			i = (i + 1) & mask;
+		}
+		return slot[i].value;
+	}
+
+	// inserts index with value 0 if it is not in the table
+	int32_t& operator[](uint32_t index) {
+		if (2 * (count + 1) > slot.size()) {
+			grow();
+		}
+		uint32_t mask = slot.size() - 1, i = home(index);
+		while (slot[i].index != EMPTY && slot[i].index != index) {
+			i = (i + 1) & mask;
+		}
+		if (slot[i].index == EMPTY) {
+			slot[i].index = index;
+			slot[i].value = 0;
+			count++;
+		}
+		return slot[i].value;
+	}
+
+	void erase(uint32_t index) {
+		if (!count) {
+			return;
+		}
+		uint32_t mask = slot.size() - 1, i = home(index);
+		while (slot[i].index != index) {
+			if (slot[i].index == EMPTY) {
+				return;
+			}
+			i = (i + 1) & mask;
+		}
+		// move back every later entry of the run whose home is not in (i, j]
+		for (uint32_t j = (i + 1) & mask; slot[j].index != EMPTY; j = (j + 1) & mask) {
+			uint32_t k = home(slot[j].index);
+			if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+				slot[i] = slot[j];
+				i = j;
+			}
+		}
+		slot[i].index = EMPTY;
+		count--;
+	}
+
+	// what the table actually holds, empty slots included
+	size_t bytes() const {
+		return slot.size() * sizeof(Entry);
+	}
+
+private:
+	struct Entry {
+		uint32_t index;
+		int32_t value;
+	};
+	static const uint32_t EMPTY = 0xFFFFFFFF;
+
+	uint32_t home(uint32_t index) const {
+		return (uint32_t)(index * 2654435761u) >> (32 - bits);
+	}
+
+	void grow() {
+		std::vector<Entry> old;
+		old.swap(slot);
+		bits = bits ? bits + 1 : 4;
+		slot.assign((size_t)1 << bits, Entry{EMPTY, 0});
+		count = 0;
+		for (const Entry& entry: old) {
+			if (entry.index != EMPTY) {
+				(*this)[entry.index] = entry.value;
+			}
+		}
+	}
+
+	std::vector<Entry> slot;
+	size_t count;
+	int bits;
+};
+
+
+// BITS-wide signed counters packed into 64-bit words (64 / BITS per word, no
+// counter straddles a word). The most negative pattern is reserved as an
+// escape: the counter has overflowed and its full value lives in an overflow
+// table until it fits into BITS again.
+template<int BITS>
+class PackedCounter {
+public:
+	static const int PER_WORD = 64 / BITS;
+	static const int32_t MAX_VALUE = (1 << (BITS - 1)) - 1;
+	static const int32_t MIN_VALUE = -MAX_VALUE;
+
+	PackedCounter(): w(0), word_num(0), word(NULL) {}
+	~PackedCounter() {
+		huge_free(word, word_num);
+	}
+	PackedCounter(const PackedCounter&) = delete;
+	PackedCounter& operator=(const PackedCounter&) = delete;
+
+	static uint32_t width(int memory, int d) {
+		return (uint64_t)memory * 1024 / sizeof(uint64_t) / d * PER_WORD;
+	}
+
+	// bytes of the words of a row of w counters, without its overflow table
+	static uint64_t row_bytes(uint32_t w) {
+		return ((uint64_t)w + PER_WORD - 1) / PER_WORD * sizeof(uint64_t);
+	}
+
+	// overflowed counters keep their full value
+	static int32_t limit() {
+		return INT32_MAX;
+	}
+
+	void init(uint32_t _w) {
+		w = _w;
+		word_num = (w + PER_WORD - 1) / PER_WORD;
+		word = huge_alloc<uint64_t>(word_num);
+		overflow.clear();
+	}
+
+	int32_t get(uint32_t index) const {
+		uint64_t raw = read(index);
+		if (raw == ESCAPE) {
+			return overflow.find(index);
+		}
+		return decode(raw);
+	}
+
+	void add(uint32_t index, int32_t value) {
+		uint64_t raw = read(index);
+		if (raw == ESCAPE) {
+			set(index, overflow[index] + value);
+			return;
+		}
+		set_inline(index, decode(raw) + value);
+	}
+
+	void set(uint32_t index, int32_t value) {
+		if (read(index) == ESCAPE && value >= MIN_VALUE && value <= MAX_VALUE) {
+			overflow.erase(index);
+		}
+		set_inline(index, value);
+	}
+
+	void load(uint32_t begin, uint32_t n, int32_t* out) const {
+		// decode without branches so the loop vectorizes, then patch escapes
+		for (uint32_t k = 0; k < n; ++k) {
+			uint32_t index = begin + k;
+			out[k] = decode((word[index / PER_WORD] >> (index % PER_WORD * BITS)) & MASK);
+		}
+		if (overflow.empty()) {
+			return;
+		}
+		for (uint32_t k = 0; k < n; ++k) {
+			if (out[k] == ESCAPE_VALUE) {
+				out[k] = overflow.find(begin + k);
+			}
+		}
+	}
+
+	size_t overflow_size() const {
+		return overflow.size();
+	}
+
+	double calculate_memory() const {
+		return (word_num * sizeof(uint64_t) + overflow.bytes()) / 1024.0;
+	}
+
+private:
+	static const uint64_t MASK = (1ULL << BITS) - 1;
+	static const uint64_t ESCAPE = 1ULL << (BITS - 1);
+	static const int32_t ESCAPE_VALUE = -(1 << (BITS - 1));
+
+	static int32_t decode(uint64_t raw) {
+		return (int32_t)((uint32_t)raw << (32 - BITS)) >> (32 - BITS);
+	}
+
+	uint64_t read(uint32_t index) const {
+		return (word[index / PER_WORD] >> (index % PER_WORD * BITS)) & MASK;
+	}
+
+	void write(uint32_t index, uint64_t raw) {
+		uint32_t shift = index % PER_WORD * BITS;
+		uint64_t& target = word[index / PER_WORD];
+		target = (target & ~(MASK << shift)) | (raw << shift);
+	}
+
+	void set_inline(uint32_t index, int32_t value) {
+		if (value < MIN_VALUE || value > MAX_VALUE) {
+			write(index, ESCAPE);
+			overflow[index] = value;
+			return;
+		}
+		write(index, (uint64_t)value & MASK);
+	}
+
+	uint32_t w, word_num;
+	uint64_t* word;
+	OverflowTable overflow;
+};
+
+
+// Sketches take either a plain integer type (wrapped in PlainCounter) or a
+// counter policy such as PackedCounter<4> as their DATA_TYPE.
+template<typename DATA_TYPE, bool = std::is_integral<DATA_TYPE>::value>
+struct CounterPolicy {
+	typedef PlainCounter<DATA_TYPE> type;
+};
+
+template<typename DATA_TYPE>
+struct CounterPolicy<DATA_TYPE, false> {
+	typedef DATA_TYPE type;
+};
+
+// Resizing of d rows of w counters indexed by h % w. widen_rows doubles the
+// width and keeps every estimate: h % 2w is h % w or h % w + w, so each
+// counter is copied into both halves.
+template<typename COUNTER>
+void widen_rows(COUNTER*& rows, int d, int& w) {
+	COUNTER* wide = new COUNTER [d];
+	for (int i = 0; i < d; ++i) {
+		wide[i].init(2 * w);
+		for (int j = 0; j < w; ++j) {
+			int32_t value = rows[i].get(j);
+			wide[i].set(j, value);
+			wide[i].set(j + w, value);
+		}
+	}
+	delete[] rows;
+	rows = wide;
+	w *= 2;
+}
+
+// fold_rows halves an even width: h % (w / 2) is (h % w) % (w / 2), so
+// counters j and j + w / 2 add up to what the narrow rows would have
+// counted, unless the rows were widened (then both halves share a copy).
+// Returns the largest sum as it would be without wrapping.
+template<typename COUNTER>
+int64_t fold_rows(COUNTER*& rows, int d, int& w) {
+	int half = w / 2;
+	int64_t peak = 0;
+	COUNTER* narrow = new COUNTER [d];
+	for (int i = 0; i < d; ++i) {
+		narrow[i].init(half);
+		for (int j = 0; j < half; ++j) {
+			int64_t value = (int64_t)rows[i].get(j) + rows[i].get(j + half);
+			narrow[i].set(j, (int32_t)value);
+			peak = value > peak ? value : peak;
+		}
+	}
+	delete[] rows;
+	rows = narrow;
+	w = half;
+	return peak;
+}
+
+#endif
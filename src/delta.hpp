@@ -0,0 +1,216 @@
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "snapshot.hpp"
+
+// Delta export between collectors. The exported state of a sketch is its
+// snapshot (save()), which is a sequence of 32-bit words; a frame holds the
+// words that changed since the previous frame as runs:
+//
+//   frame: kind byte, varint word count, then runs up to the end of the frame
+//   run:   varint gap (unchanged words skipped), varint length,
+//          length zigzag varints (new word - old word)
+//
+// A full frame (the first one, and any after the sketch changed shape, e.g.
+// by an expansion) is encoded against all-zero words.
+
+#define DELTA_CHANGES 0
+#define DELTA_FULL 1
+// largest image a DeltaDecoder accepts by default, in bytes
+#define DELTA_MAX_IMAGE (256u << 20)
+
+// first i in [begin, n) with a[i] != b[i], or n
+inline size_t next_change(const uint32_t* a, const uint32_t* b, size_t begin, size_t n) {
+#ifdef __AVX2__
+	for (; begin + 8 <= n; begin += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + begin)), y = _mm256_loadu_si256((const __m256i*)(b + begin));
+		uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y));
+		if (equal != 0xFFFFFFFF) {
+			return begin + __builtin_ctz(~equal) / 4;
+		}
+	}
+#endif
+#ifdef __SSE2__
+	for (; begin + 4 <= n; begin += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + begin)), y = _mm_loadu_si128((const __m128i*)(b + begin));
+		uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi32(x, y));
+		if (equal != 0xFFFF) {
+			return begin + __builtin_ctz(~equal) / 4;
+		}
+	}
+#endif
+	while (begin < n && a[begin] == b[begin]) {
+		begin++;
+	}
+	return begin;
+}
+
+inline uint8_t* put_varint(uint8_t* p, uint32_t value) {
+	while (value >= 0x80) {
+		*p++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+// NULL if the varint runs past end
+inline const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint32_t& value) {
+	value = 0;
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		uint8_t byte = *p++;
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+inline uint32_t zigzag(uint32_t delta) {
+	return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+inline uint32_t unzigzag(uint32_t value) {
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Keeps the state of the last frame it produced.
+class DeltaEncoder {
+public:
+	// the changes of sketch since the previous encode()
+	template<typename SKETCH>
+	void encode(SKETCH& sketch, std::vector<uint8_t>& frame) {
+		image(sketch, current);
+		encode_image(current, frame);
+	}
+
+	template<typename SKETCH>
+	static void image(SKETCH& sketch, std::vector<char>& out) {
+		out.clear();
+		SnapshotWriter writer(out);
+		std::ostream stream(&writer);
+		sketch.save(stream);
+	}
+
+	// Frame for a snapshot image; the image becomes the base of the next
+	// frame. next is consumed: it is swapped with the old base, so it holds
+	// stale words afterwards.
+	void encode_image(std::vector<char>& next, std::vector<uint8_t>& frame) {
+		size_t n = next.size() / sizeof(uint32_t);
+		bool full = previous.size() != next.size();
+		if (full) {
+			previous.assign(next.size(), 0);
+		}
+		const uint32_t* a = (const uint32_t*)next.data();
+		const uint32_t* b = (const uint32_t*)previous.data();
+		frame.resize(16);
+		uint8_t* p = frame.data();
+		*p++ = full ? DELTA_FULL : DELTA_CHANGES;
+		p = put_varint(p, n);
+		size_t used = p - frame.data(), last = 0;
+		for (size_t i = next_change(a, b, 0, n); i < n; i = next_change(a, b, i, n)) {
+			size_t end = i + 1;
+			while (end < n && a[end] != b[end]) {
+				end++;
+			}
+			// gap and length, then at most 5 bytes per word
+			size_t need = used + 10 + (end - i) * 5;
+			if (frame.size() < need) {
+				frame.resize(need > 2 * frame.size() ? need : 2 * frame.size());
+			}
+			p = frame.data() + used;
+			p = put_varint(p, i - last);
+			p = put_varint(p, end - i);
+			for (; i < end; ++i) {
+				p = put_varint(p, zigzag(a[i] - b[i]));
+			}
+			used = p - frame.data();
+			last = end;
+		}
+		frame.resize(used);
+		previous.swap(next);
+	}
+
+	// the next frame will be a full one
+	void reset() {
+		previous.clear();
+	}
+
+private:
+	std::vector<char> previous, current;
+};
+
+// Applies frames in order and keeps the image they add up to. A frame that
+// claims an image above max_bytes is malformed, so a few bytes off the wire
+// cannot make it allocate more.
+class DeltaDecoder {
+public:
+	DeltaDecoder(size_t _max_bytes = DELTA_MAX_IMAGE): max_bytes(_max_bytes) {}
+
+	// Applies frame and loads the result into sketch. False for a malformed
+	// frame or a delta whose base was never applied; after that only a full
+	// frame is accepted.
+	template<typename SKETCH>
+	bool apply(const uint8_t* frame, size_t n, SKETCH& sketch) {
+		if (!apply_image(frame, n)) {
+			return false;
+		}
+		SnapshotReader reader(image.data(), image.size());
+		std::istream stream(&reader);
+		return sketch.load(stream);
+	}
+
+	bool apply_image(const uint8_t* frame, size_t n) {
+		if (!apply_runs(frame, n)) {
+			image.clear();
+			return false;
+		}
+		return true;
+	}
+
+	std::vector<char> image;
+
+private:
+	bool apply_runs(const uint8_t* frame, size_t n) {
+		const uint8_t* p = frame;
+		const uint8_t* end = frame + n;
+		uint32_t words;
+		if (n < 1 || !(p = get_varint(p + 1, end, words)) || (uint64_t)words * sizeof(uint32_t) > max_bytes) {
+			return false;
+		}
+		if (frame[0] == DELTA_FULL) {
+			image.assign((size_t)words * sizeof(uint32_t), 0);
+		}
+		else if (frame[0] != DELTA_CHANGES || image.size() != (size_t)words * sizeof(uint32_t)) {
+			return false;
+		}
+		uint32_t* word = (uint32_t*)image.data();
+		size_t position = 0;
+		while (p < end) {
+			uint32_t gap, length, value;
+			if (!(p = get_varint(p, end, gap)) || !(p = get_varint(p, end, length)) || position + gap + length > words) {
+				return false;
+			}
+			position += gap;
+			for (uint32_t k = 0; k < length; ++k, ++position) {
+				if (!(p = get_varint(p, end, value))) {
+					return false;
+				}
+				word[position] += unzigzag(value);
+			}
+		}
+		return true;
+	}
+
+	size_t max_bytes;
+};
+
+#endif
@@ -10,19 +10,58 @@
 #include <stdexcept>
 #include "hash.hpp"
 #include "sketch.hpp"
+#include "memory.hpp"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 
+#define ELASTIC_LAMBDA 8
+
+// One cache line per bucket: as many (key, positive vote) slots as fit next
+// to the shared negative vote and the per-slot flag bits. A set flag bit
+// means that slot's key may also have counts in the CM sketch.
 template<typename ID_TYPE>
-class Bucket_Elastic {
+class alignas(64) Bucket_Elastic {
 public:
-    ID_TYPE key = 0;
-    int32_t pos_vote = 0;
-    int32_t neg_vote = 0;
-    bool flag = false;
+    static const int SLOTS = (64 - 2 * sizeof(uint32_t)) / (sizeof(ID_TYPE) + sizeof(uint32_t));
+    ID_TYPE key[SLOTS];
+    uint32_t pos_vote[SLOTS];
+    uint32_t neg_vote;
+    uint32_t flag;
+};
+
+// bit s is set if key[s] == key
+template<typename ID_TYPE, int SLOTS>
+struct ElasticMatch {
+    static uint32_t mask(const ID_TYPE* keys, const ID_TYPE& key) {
+        uint32_t result = 0;
+        for (int s = 0; s < SLOTS; ++s) {
+            result |= (uint32_t)(keys[s] == key) << s;
+        }
+        return result;
+    }
 };
 
+#ifdef __AVX2__
+template<>
+struct ElasticMatch<uint64_t, 4> {
+    static uint32_t mask(const uint64_t* keys, const uint64_t& key) {
+        __m256i cmp = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)keys), _mm256_set1_epi64x(key));
+        return _mm256_movemask_pd(_mm256_castsi256_pd(cmp));
+    }
+};
 
+template<>
+struct ElasticMatch<uint32_t, 7> {
+    // the eighth lane reads pos_vote[0], which is still inside the bucket
+    static uint32_t mask(const uint32_t* keys, const uint32_t& key) {
+        __m256i cmp = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)keys), _mm256_set1_epi32(key));
+        return _mm256_movemask_ps(_mm256_castsi256_ps(cmp)) & 0x7F;
+    }
+};
+#endif
 
 
 template<typename ID_TYPE>
@@ -30,50 +69,70 @@ class ElasticSketch : public Sketch<ID_TYPE> {
 public:
     ElasticSketch(int memory) {
         array_size = 0.5 * memory * 1024 / sizeof(Bucket_Elastic<ID_TYPE>);
-        bucket = new Bucket_Elastic<ID_TYPE>[array_size];
+        bucket = huge_alloc<Bucket_Elastic<ID_TYPE>>(array_size);
+        for (int i = 0; i < array_size; ++i) {
+            for (int s = 0; s < SLOTS; ++s) {
+                bucket[i].key[s] = KeyTraits<ID_TYPE>::empty();
+            }
+        }
         cmsketch = new CMSketch<ID_TYPE, uint16_t>(0.5 * memory, 3);
     }
 
     ~ElasticSketch() {
-        delete[] bucket;
+        huge_free(bucket, array_size);
         delete cmsketch;
     }
     void insert(ID_TYPE key, int32_t value) {
-        uint32_t index = ::hash(key, 50) % array_size;
-        if (bucket[index].key == key) {
-            bucket[index].pos_vote++;
+        Bucket_Elastic<ID_TYPE>& b = bucket[::hash(key, 50) % array_size];
+        uint32_t mask = MATCH::mask(b.key, key);
+        if (mask) {
+            b.pos_vote[__builtin_ctz(mask)] += value;
+            return;
         }
-        else if (!bucket[index].key){
-            bucket[index].key = key;
-            bucket[index].pos_vote = value;
+        mask = MATCH::mask(b.key, KeyTraits<ID_TYPE>::empty());
+        if (mask) {
+            int slot = __builtin_ctz(mask);
+            b.key[slot] = key;
+            b.pos_vote[slot] = value;
+            b.flag &= ~(1u << slot);
+            return;
         }
-        else {
-            bucket[index].neg_vote++;
-            if (bucket[index].neg_vote >= 8 * bucket[index].pos_vote) {
-                cmsketch->insert(bucket[index].key, bucket[index].pos_vote);
-                bucket[index].key = key;
-                bucket[index].pos_vote = value;
-                bucket[index].neg_vote = 0;
-                bucket[index].flag = true;
-            }
-            else {
-                cmsketch->insert(key, value);
+        // weighted vote against the weakest resident
+        int slot = 0;
+        for (int s = 1; s < SLOTS; ++s) {
+            if (b.pos_vote[s] < b.pos_vote[slot]) {
+                slot = s;
             }
         }
+        b.neg_vote += value;
+        if (b.neg_vote >= ELASTIC_LAMBDA * b.pos_vote[slot]) {
+            cmsketch->insert(b.key[slot], b.pos_vote[slot]);
+            b.key[slot] = key;
+            b.pos_vote[slot] = value;
+            b.neg_vote = 0;
+            b.flag |= 1u << slot;
+        }
+        else {
+            cmsketch->insert(key, value);
+        }
     }
     int32_t query(ID_TYPE key) {
-        int32_t result = 0;
-        uint32_t index = ::hash(key, 50) % array_size;
-        if (bucket[index].key == key) {
-            result += bucket[index].pos_vote;
-            if (!bucket[index].flag) {
-                return result;
+        Bucket_Elastic<ID_TYPE>& b = bucket[::hash(key, 50) % array_size];
+        uint32_t mask = MATCH::mask(b.key, key);
+        if (mask) {
+            int slot = __builtin_ctz(mask);
+            int32_t result = b.pos_vote[slot];
+            if (b.flag >> slot & 1) {
+                result += cmsketch->query(key);
             }
+            return result;
         }
-        result += cmsketch->query(key);
-        return result;
+        return cmsketch->query(key);
     }
 private:
+    static const int SLOTS = Bucket_Elastic<ID_TYPE>::SLOTS;
+    typedef ElasticMatch<ID_TYPE, SLOTS> MATCH;
+
     Bucket_Elastic<ID_TYPE>* bucket;
     int array_size;
     CMSketch<ID_TYPE, uint16_t>* cmsketch;
@@ -91,5 +150,4 @@ private:
 
 
 
-
 #endif
\ No newline at end of file
@@ -7,22 +7,74 @@
 #include <limits.h>
 #include <stdint.h>
 #include "BOBHash32.hpp"
+#include "key.hpp"
+
+#define RANDOM_POOL_SIZE 64
 
 template<typename T>
 inline uint32_t hash(const T& data, uint32_t seed = 0);
 inline uint32_t randomGenerator();
 
-static std::random_device rd;
-static std::mt19937 rng(rd());
-static std::uniform_real_distribution<double> dis(0, 1);
+// wyrand: 64-bit state, one multiply per word. Instances are independent and
+// fully determined by their seed, so runs are reproducible.
+class WyRand {
+public:
+    explicit WyRand(uint64_t seed = 0): state(seed) {}
+
+    uint64_t next() {
+        state += 0xa0761d6478bd642fULL;
+        __uint128_t t = (__uint128_t)state * (state ^ 0xe7037ed1a0b428dbULL);
+        return (uint64_t)(t >> 64) ^ (uint64_t)t;
+    }
+
+    void fill(uint64_t* out, int n) {
+        for (int i = 0; i < n; ++i) {
+            out[i] = next();
+        }
+    }
+
+private:
+    uint64_t state;
+};
+
+// true with probability numerator / denominator (denominator <= 2^32), using
+// the high 32 bits of a random word and no division
+inline bool random_below(uint64_t word, uint64_t numerator, uint64_t denominator) {
+    return ((word >> 32) * denominator >> 32) < numerator;
+}
+
+// WyRand that generates RANDOM_POOL_SIZE words at a time for hot paths
+class RandomPool {
+public:
+    explicit RandomPool(uint64_t seed = 0): rng(seed), pos(RANDOM_POOL_SIZE) {}
+
+    uint64_t next() {
+        if (pos == RANDOM_POOL_SIZE) {
+            rng.fill(pool, RANDOM_POOL_SIZE);
+            pos = 0;
+        }
+        return pool[pos++];
+    }
+
+    bool bernoulli(uint64_t numerator, uint64_t denominator) {
+        return random_below(next(), numerator, denominator);
+    }
+
+private:
+    WyRand rng;
+    uint64_t pool[RANDOM_POOL_SIZE];
+    int pos;
+};
+
+static WyRand rng(0x5eed);
 
 inline uint32_t randomGenerator(){
-    return rng();
+    return rng.next() >> 32;
 }
 
 template<typename T>
 inline uint32_t hash(const T& data, uint32_t seed){
-    return BOBHash::BOBHash32((uint8_t*)&data, sizeof(T), seed);
+    return KeyTraits<T>::hash(data, seed);
     // uint32_t output;
     // MurmurHash3_x86_32(&data, sizeof(T), seed, &output);
     // return output;
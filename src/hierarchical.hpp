@@ -0,0 +1,203 @@
+#ifndef HIERARCHICAL_H_
+#define HIERARCHICAL_H_
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+#include "weavesketch.hpp"
+
+using namespace std;
+
+// An address prefix of one level of a HierarchicalWeaveSketch, with its hash
+// computed once per packet. The length is implied by the level's sketch.
+struct PrefixKey {
+	uint32_t address;   // masked, host byte order
+	uint32_t hash;      // never 0, so the all-zero key stays empty
+};
+
+inline bool operator==(const PrefixKey& a, const PrefixKey& b) {
+	return a.address == b.address && a.hash == b.hash;
+}
+
+inline bool operator!=(const PrefixKey& a, const PrefixKey& b) {
+	return !(a == b);
+}
+
+inline bool operator<(const PrefixKey& a, const PrefixKey& b) {
+	return a.address < b.address || (a.address == b.address && a.hash < b.hash);
+}
+
+inline uint32_t mix_hash(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+// The sketches hash a PrefixKey once per seed; each is a remix of the cached
+// hash instead of another pass over the key bytes.
+template<>
+struct KeyTraits<PrefixKey> {
+	static const bool out_of_line = false;
+
+	static PrefixKey empty() {
+		return PrefixKey{0, 0};
+	}
+
+	static bool is_empty(const PrefixKey& key) {
+		return !key.hash;
+	}
+
+	static uint32_t hash(const PrefixKey& key, uint32_t seed) {
+		return mix_hash(key.hash ^ prime[seed]);
+	}
+
+	static void xor_into(PrefixKey& target, const PrefixKey& key) {
+		target.address ^= key.address;
+		target.hash ^= key.hash;
+	}
+};
+
+namespace std {
+template<>
+struct hash<PrefixKey> {
+	size_t operator()(const PrefixKey& key) const {
+		return key.hash;
+	}
+};
+}
+
+struct HierarchicalHeavyHitter {
+	uint32_t address;
+	int length;
+	int32_t count;
+	// count minus the HHHs below it that no other HHH below it already covers
+	int32_t discounted;
+};
+
+// One WeaveSketch per prefix length. A packet's prefix keys are derived
+// from each other (coarsest first, one mixing round per level), and batches
+// prefetch the heavy buckets of every level before updating any of them.
+template<typename DATA_TYPE = int8_t>
+class HierarchicalWeaveSketch {
+public:
+	// lengths such as {32, 24, 16}; memory is the total over all levels
+	HierarchicalWeaveSketch(vector<int> lengths, uint32_t memory, int d, int max_expansion_time, int max_error, double memory_ratio) {
+		sort(lengths.begin(), lengths.end());
+		lengths.erase(unique(lengths.begin(), lengths.end()), lengths.end());
+		length = lengths;
+		for (int l: length) {
+			mask.push_back(l ? ~0u << (32 - l) : 0);
+			level.push_back(new WeaveSketch<PrefixKey, DATA_TYPE>(memory / length.size(), d, max_expansion_time, max_error, memory_ratio));
+		}
+	}
+
+	~HierarchicalWeaveSketch() {
+		for (auto sketch: level) {
+			delete sketch;
+		}
+	}
+
+	int levels() const {
+		return length.size();
+	}
+
+	int level_length(int l) const {
+		return length[l];
+	}
+
+	// the prefix keys of address at every level, coarsest first
+	void keys(uint32_t address, PrefixKey* out) const {
+		uint32_t h = 0x9747b28c;
+		for (int l = 0; l < levels(); ++l) {
+			uint32_t masked = address & mask[l];
+			h = mix_hash(h ^ masked ^ (uint32_t)length[l] << 24);
+			out[l] = PrefixKey{masked, h ? h : 1};
+		}
+	}
+
+	void insert(uint32_t address, int32_t value) {
+		PrefixKey key[MAX_LEVEL];
+		keys(address, key);
+		for (int l = 0; l < levels(); ++l) {
+			level[l]->insert(key[l], value);
+		}
+	}
+
+	void insert_batch(const uint32_t* addresses, int n) {
+		PrefixKey key[QUERY_BATCH][MAX_LEVEL];
+		for (int begin = 0; begin < n; begin += QUERY_BATCH) {
+			int end = MIN(n, begin + QUERY_BATCH);
+			for (int k = begin; k < end; ++k) {
+				keys(addresses[k], key[k - begin]);
+				for (int l = 0; l < levels(); ++l) {
+					level[l]->prefetch(key[k - begin][l]);
+				}
+			}
+			for (int k = begin; k < end; ++k) {
+				for (int l = 0; l < levels(); ++l) {
+					level[l]->insert(key[k - begin][l], 1);
+				}
+			}
+		}
+	}
+
+	// count of address's prefix at level l
+	int32_t query(uint32_t address, int l) {
+		PrefixKey key[MAX_LEVEL];
+		keys(address, key);
+		return level[l]->query(key[l]);
+	}
+
+	void query_levels(uint32_t address, int32_t* out) {
+		PrefixKey key[MAX_LEVEL];
+		keys(address, key);
+		for (int l = 0; l < levels(); ++l) {
+			out[l] = level[l]->query(key[l]);
+		}
+	}
+
+	// Prefixes whose count, after discounting the hierarchical heavy hitters
+	// below them, still reaches threshold; finest level first.
+	vector<HierarchicalHeavyHitter> hierarchical_heavy_hitters(int32_t threshold) {
+		vector<HierarchicalHeavyHitter> result;
+		vector<bool> covered;
+		for (int l = levels() - 1; l >= 0; --l) {
+			size_t finer = result.size();
+			for (auto& item: level[l]->heavy_hitters(threshold)) {
+				int32_t discounted = item.second;
+				for (size_t i = 0; i < finer; ++i) {
+					if (!covered[i] && (result[i].address & mask[l]) == item.first.address) {
+						discounted -= result[i].count;
+					}
+				}
+				if (discounted >= threshold) {
+					result.push_back(HierarchicalHeavyHitter{item.first.address, length[l], item.second, discounted});
+					covered.push_back(false);
+				}
+			}
+			// an HHH at this level stands in for the finer ones it contains
+			for (size_t i = 0; i < finer; ++i) {
+				for (size_t j = finer; j < result.size() && !covered[i]; ++j) {
+					covered[i] = (result[i].address & mask[l]) == result[j].address;
+				}
+			}
+		}
+		return result;
+	}
+
+	WeaveSketch<PrefixKey, DATA_TYPE>* sketch(int l) {
+		return level[l];
+	}
+
+	static const int MAX_LEVEL = 33;
+
+private:
+	vector<int> length;
+	vector<uint32_t> mask;
+	vector<WeaveSketch<PrefixKey, DATA_TYPE>*> level;
+};
+
+#endif
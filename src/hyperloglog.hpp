@@ -0,0 +1,63 @@
+#ifndef HYPERLOGLOG_H_
+#define HYPERLOGLOG_H_
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+// HyperLogLog registers fed with a 32-bit hash the caller already has: the
+// top precision bits pick the register, the rest give the rank.
+class HyperLogLog {
+public:
+	HyperLogLog(int _precision): precision(_precision), m(1u << _precision) {
+		reg = new uint8_t [m];
+		memset(reg, 0, m);
+	}
+
+	~HyperLogLog() {
+		delete[] reg;
+	}
+
+	void insert_hash(uint32_t h) {
+		uint32_t index = h >> (32 - precision);
+		uint8_t rank = __builtin_clz((h << precision) | (1u << (precision - 1))) + 1;
+		if (rank > reg[index]) {
+			reg[index] = rank;
+		}
+	}
+
+	// distinct hashes seen, with the usual small- and large-range corrections
+	double estimate() const {
+		double sum = 0;
+		uint32_t zeros = 0;
+		for (uint32_t i = 0; i < m; ++i) {
+			sum += ldexp(1.0, -reg[i]);
+			zeros += !reg[i];
+		}
+		double alpha = 0.7213 / (1 + 1.079 / m);
+		double e = alpha * m * m / sum;
+		if (e <= 2.5 * m && zeros) {
+			return m * log((double)m / zeros);
+		}
+		const double range = 4294967296.0;
+		if (e > range / 30) {
+			return -range * log(1 - e / range);
+		}
+		return e;
+	}
+
+	void clear() {
+		memset(reg, 0, m);
+	}
+
+	double calculate_memory() {
+		return m / 1024.0;
+	}
+
+private:
+	int precision;
+	uint32_t m;
+	uint8_t* reg;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef INVERTIBLE_H_
+#define INVERTIBLE_H_
+
+#include <cstring>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "hash.hpp"
+#include "memory.hpp"
+
+#define INVERTIBLE_HASH_NUM 3
+
+template<typename ID_TYPE>
+class InvertibleCell {
+public:
+	ID_TYPE key_sum;
+	uint32_t hash_sum;
+	int32_t flow_count;
+	int32_t packet_count;
+};
+
+// FlowRadar-style invertible counting table. A Bloom filter tells new keys
+// apart; a new key is XORed into the key_sum (and its hash into the hash_sum)
+// of one cell per row and counted in flow_count, while every insert adds to
+// packet_count. decode() peels cells holding a single flow to recover
+// (key, count) pairs without knowing the keys in advance.
+template<typename ID_TYPE>
+class InvertibleLightPart {
+public:
+	InvertibleLightPart(int memory) {
+		// a fifth of the memory for the Bloom filter, the rest for the cells
+		bloom_size = memory * 1024 / 5 / sizeof(uint64_t) * 64;
+		w = (memory * 1024 - bloom_size / 8) / sizeof(InvertibleCell<ID_TYPE>) / INVERTIBLE_HASH_NUM;
+		bloom = huge_alloc<uint64_t>(bloom_size / 64);
+		cell = huge_alloc<InvertibleCell<ID_TYPE>>(w * INVERTIBLE_HASH_NUM);
+	}
+
+	~InvertibleLightPart() {
+		huge_free(bloom, bloom_size / 64);
+		huge_free(cell, w * INVERTIBLE_HASH_NUM);
+	}
+
+	void insert(ID_TYPE key, int32_t value) {
+		bool new_flow = false;
+		for (int i = 0; i < INVERTIBLE_HASH_NUM; ++i) {
+			uint32_t bit = ::hash(key, 400 + i) % bloom_size;
+			if (!(bloom[bit / 64] >> (bit % 64) & 1)) {
+				bloom[bit / 64] |= 1ULL << (bit % 64);
+				new_flow = true;
+			}
+		}
+		for (int i = 0; i < INVERTIBLE_HASH_NUM; ++i) {
+			InvertibleCell<ID_TYPE>& c = cell[index(key, i)];
+			if (new_flow) {
+				KeyTraits<ID_TYPE>::xor_into(c.key_sum, key);
+				c.hash_sum ^= ::hash(key, 399);
+				c.flow_count++;
+			}
+			c.packet_count += value;
+		}
+	}
+
+	// every flow that can be peeled, with its total count
+	std::vector<std::pair<ID_TYPE, int32_t>> decode() const {
+		std::vector<std::pair<ID_TYPE, int32_t>> result;
+		uint32_t cell_num = w * INVERTIBLE_HASH_NUM;
+		std::vector<InvertibleCell<ID_TYPE>> table(cell, cell + cell_num);
+		std::vector<uint32_t> pure;
+		for (uint32_t k = 0; k < cell_num; ++k) {
+			if (table[k].flow_count == 1) {
+				pure.push_back(k);
+			}
+		}
+		while (!pure.empty()) {
+			uint32_t k = pure.back();
+			pure.pop_back();
+			if (table[k].flow_count != 1) {
+				continue;
+			}
+			ID_TYPE key = table[k].key_sum;
+			int32_t count = table[k].packet_count;
+			// a real single flow matches the hash_sum and hashes back to this cell
+			if (::hash(key, 399) != table[k].hash_sum || index(key, k / w) != k) {
+				continue;
+			}
+			result.push_back(std::make_pair(key, count));
+			for (int i = 0; i < INVERTIBLE_HASH_NUM; ++i) {
+				InvertibleCell<ID_TYPE>& c = table[index(key, i)];
+				KeyTraits<ID_TYPE>::xor_into(c.key_sum, key);
+				c.hash_sum ^= ::hash(key, 399);
+				c.flow_count--;
+				c.packet_count -= count;
+				if (c.flow_count == 1) {
+					pure.push_back(index(key, i));
+				}
+			}
+		}
+		return result;
+	}
+
+	double calculate_memory() {
+		return (bloom_size / 8 + w * INVERTIBLE_HASH_NUM * sizeof(InvertibleCell<ID_TYPE>)) / 1024.0;
+	}
+
+private:
+	// row i owns cells [i * w, (i + 1) * w)
+	uint32_t index(const ID_TYPE& key, int i) const {
+		return i * w + ::hash(key, 300 + i) % w;
+	}
+
+	uint32_t bloom_size, w;
+	uint64_t* bloom;
+	InvertibleCell<ID_TYPE>* cell;
+};
+
+#endif
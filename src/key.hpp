@@ -0,0 +1,154 @@
+#ifndef KEY_H_
+#define KEY_H_
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "BOBHash32.hpp"
+
+// Key traits used by the sketches: an explicit empty key, the hash for a
+// given seed, and whether the heavy part should keep the key out of line.
+// The default covers integer IDs: 0 is empty and the bytes go through BOBHash.
+template<typename T>
+struct KeyTraits {
+	static const bool out_of_line = sizeof(T) > sizeof(uint64_t);
+
+	static T empty() {
+		return T();
+	}
+
+	static bool is_empty(const T& key) {
+		return key == T();
+	}
+
+	static uint32_t hash(const T& key, uint32_t seed) {
+		return BOBHash::BOBHash32((const uint8_t*)&key, sizeof(T), seed);
+	}
+
+	static void xor_into(T& target, const T& key) {
+		target ^= key;
+	}
+};
+
+
+// Fixed-width flow key of N meaningful bytes, zero padded to whole 64-bit
+// words so comparisons and hashing work a word at a time. The all-zero key
+// (FixedKey<N>()) is the empty sentinel.
+template<int N>
+struct FixedKey {
+	static const int WORDS = (N + 7) / 8;
+
+	FixedKey() = default;
+
+	explicit FixedKey(const uint8_t* bytes) {
+		memset(word, 0, sizeof(word));
+		memcpy(word, bytes, N);
+	}
+
+	const uint8_t* data() const {
+		return (const uint8_t*)word;
+	}
+
+	uint64_t word[WORDS];
+};
+
+typedef FixedKey<13> FiveTuple;      // IPv4 src, dst, sport, dport, proto
+typedef FixedKey<37> FiveTupleV6;    // IPv6 src, dst, sport, dport, proto
+
+template<int WORDS>
+struct FixedKeyEqual {
+	static bool equal(const uint64_t* a, const uint64_t* b) {
+		uint64_t diff = 0;
+		for (int i = 0; i < WORDS; ++i) {
+			diff |= a[i] ^ b[i];
+		}
+		return !diff;
+	}
+};
+
+#ifdef __SSE2__
+template<>
+struct FixedKeyEqual<2> {
+	static bool equal(const uint64_t* a, const uint64_t* b) {
+		__m128i x = _mm_loadu_si128((const __m128i*)a), y = _mm_loadu_si128((const __m128i*)b);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+	}
+};
+#endif
+
+template<int N>
+inline bool operator==(const FixedKey<N>& a, const FixedKey<N>& b) {
+	return FixedKeyEqual<FixedKey<N>::WORDS>::equal(a.word, b.word);
+}
+
+template<int N>
+inline bool operator!=(const FixedKey<N>& a, const FixedKey<N>& b) {
+	return !(a == b);
+}
+
+template<int N>
+inline bool operator<(const FixedKey<N>& a, const FixedKey<N>& b) {
+	return memcmp(a.word, b.word, sizeof(a.word)) < 0;
+}
+
+template<int N>
+std::ostream& operator<<(std::ostream& out, const FixedKey<N>& key) {
+	const char* digits = "0123456789abcdef";
+	for (int i = 0; i < N; ++i) {
+		out << digits[key.data()[i] >> 4] << digits[key.data()[i] & 15];
+	}
+	return out;
+}
+
+inline uint64_t mix_word(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+template<int N>
+struct KeyTraits<FixedKey<N>> {
+	static const bool out_of_line = sizeof(FixedKey<N>) > sizeof(uint64_t);
+
+	static FixedKey<N> empty() {
+		return FixedKey<N>();
+	}
+
+	static bool is_empty(const FixedKey<N>& key) {
+		return key == FixedKey<N>();
+	}
+
+	// one multiply-rotate round per word instead of BOBHash's byte loads
+	static uint32_t hash(const FixedKey<N>& key, uint32_t seed) {
+		uint64_t h = prime[seed] * 0x9e3779b97f4a7c15ULL + N;
+		for (int i = 0; i < FixedKey<N>::WORDS; ++i) {
+			h ^= key.word[i] * 0x87c37b91114253d5ULL;
+			h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+		}
+		return mix_word(h) >> 32;
+	}
+
+	static void xor_into(FixedKey<N>& target, const FixedKey<N>& key) {
+		for (int i = 0; i < FixedKey<N>::WORDS; ++i) {
+			target.word[i] ^= key.word[i];
+		}
+	}
+};
+
+namespace std {
+template<int N>
+struct hash<FixedKey<N>> {
+	size_t operator()(const FixedKey<N>& key) const {
+		return KeyTraits<FixedKey<N>>::hash(key, 0);
+	}
+};
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef DATASET_H_
 #define DATASET_H_
 
+#include <cerrno>
 #include <cinttypes>
 #include <iostream>
 #include <fstream>
@@ -13,6 +14,17 @@
 #include <cmath>
 #include <chrono>
 #include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "key.hpp"
+#include "pcap.hpp"
 using namespace std;
 
 vector<pair<uint64_t, uint64_t>> loadCAIDA(const char *filename, int length) {
@@ -41,6 +53,221 @@ vector<pair<uint64_t, uint64_t>> loadCAIDA(const char *filename, int length) {
 	return dataset;
 }
 
+// CAIDA records with their absolute timestamps, first packets of flows included
+vector<pair<uint64_t, uint64_t>> loadCAIDATimed(const char *filename, int length) {
+	FILE *pf = fopen(filename, "rb");
+	if (!pf) {
+		printf("%s not found!\n", filename);
+		exit(-1);
+	}
+	vector<pair<uint64_t, uint64_t>> dataset;
+	dataset.clear();
+
+	char trace[30];
+	while (fread(trace, 1, 21, pf)) {
+		uint64_t tkey = *(uint64_t *)(trace);
+		uint64_t ttime = *(uint64_t *)(trace + 13);
+		dataset.push_back(pair<uint64_t, uint64_t>(tkey, ttime));
+		if (dataset.size() == length)
+			break;
+	}
+	fclose(pf);
+	return dataset;
+}
+
+// a directory (its regular files) or a glob pattern, sorted by name
+vector<string> expandTracePaths(const char *pattern) {
+	vector<string> paths;
+	struct stat st;
+	if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(pattern);
+		if (dir) {
+			while (struct dirent *entry = readdir(dir)) {
+				string path = string(pattern) + "/" + entry->d_name;
+				if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+					paths.push_back(path);
+			}
+			closedir(dir);
+		}
+	}
+	else {
+		glob_t result;
+		if (glob(pattern, 0, NULL, &result) == 0) {
+			for (size_t i = 0; i < result.gl_pathc; ++i)
+				paths.push_back(result.gl_pathv[i]);
+		}
+		globfree(&result);
+	}
+	sort(paths.begin(), paths.end());
+	return paths;
+}
+
+#define TRACE_READ_SIZE (16 << 20)
+
+// One file of 21-byte records, with inter-arrival times computed within the
+// file. The first packet of a flow in the file has no predecessor here and
+// keeps its timestamp until stitchTraceFiles() looks at earlier files.
+struct TraceFile {
+	struct Record {
+		uint64_t key, value;
+		bool first;
+	};
+	vector<Record> records;
+	unordered_map<uint64_t, uint64_t> last_come;
+	uint64_t known;           // records that are not first in the file
+};
+
+// False with errno set if the file cannot be opened or a read fails.
+bool readTraceFile(const char *filename, TraceFile &file) {
+	int fd = -1;
+#ifdef O_DIRECT
+	fd = open(filename, O_RDONLY | O_DIRECT);
+#endif
+	bool direct = fd >= 0;
+	if (!direct)
+		fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	char *buffer = NULL;
+	// O_DIRECT wants offsets, sizes and the buffer aligned to the block size
+	int error = posix_memalign((void **)&buffer, 4096, TRACE_READ_SIZE);
+	if (error) {
+		close(fd);
+		errno = error;
+		return false;
+	}
+	struct stat st;
+	bool sized = fstat(fd, &st) == 0;
+	if (sized)
+		file.records.reserve(st.st_size / 21);
+	file.known = 0;
+	char trace[21];
+	int carry = 0;
+	off_t offset = 0;
+	while (true) {
+		ssize_t n = pread(fd, buffer, TRACE_READ_SIZE, offset);
+		if (n < 0 && direct && (offset == 0 || errno == EINVAL)) {
+			// the file system refused O_DIRECT after all, or an unaligned offset
+			close(fd);
+			fd = open(filename, O_RDONLY);
+			direct = false;
+			if (fd < 0) {
+				free(buffer);
+				return false;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			// a failed read is not the end of the file
+			error = errno;
+			free(buffer);
+			close(fd);
+			errno = error;
+			return false;
+		}
+		if (n == 0)
+			break;
+		offset += n;
+		ssize_t pos = 0;
+		while (pos < n) {
+			// a record may straddle two reads
+			int take = MIN((ssize_t)(21 - carry), n - pos);
+			memcpy(trace + carry, buffer + pos, take);
+			carry += take;
+			pos += take;
+			if (carry < 21)
+				break;
+			carry = 0;
+			uint64_t tkey = *(uint64_t *)(trace);
+			uint64_t ttime = *(uint64_t *)(trace + 13);
+			auto it = file.last_come.find(tkey);
+			if (it == file.last_come.end()) {
+				file.records.push_back(TraceFile::Record{tkey, ttime, true});
+				file.last_come.emplace(tkey, ttime);
+			}
+			else {
+				file.records.push_back(TraceFile::Record{tkey, ttime - it->second, false});
+				it->second = ttime;
+				file.known++;
+			}
+		}
+		// a short last read leaves offset unaligned for O_DIRECT; do not read past it
+		if (sized && offset >= st.st_size)
+			break;
+	}
+	free(buffer);
+	close(fd);
+	return true;
+}
+
+// Files in order, as if they were one trace: the first packet of a flow in a
+// file gets its inter-arrival time from the flow's last packet in earlier
+// files, or is dropped like the first packet of a flow in loadCAIDA.
+vector<pair<uint64_t, uint64_t>> stitchTraceFiles(vector<TraceFile> &files, int length) {
+	vector<pair<uint64_t, uint64_t>> dataset;
+	unordered_map<uint64_t, uint64_t> last_come;
+	for (auto &file : files) {
+		for (auto &record : file.records) {
+			if (dataset.size() == length)
+				return dataset;
+			if (!record.first) {
+				dataset.push_back(pair<uint64_t, uint64_t>(record.key, record.value));
+				continue;
+			}
+			auto it = last_come.find(record.key);
+			if (it != last_come.end())
+				dataset.push_back(pair<uint64_t, uint64_t>(record.key, record.value - it->second));
+		}
+		for (auto &p : file.last_come)
+			last_come[p.first] = p.second;
+		vector<TraceFile::Record>().swap(file.records);
+	}
+	return dataset;
+}
+
+// CAIDA/MAWI 21-byte records from every file matching pattern (a directory
+// or a glob such as ".../dataset/1301*.dat"), in name order. A pool of
+// threads reads and parses whole files; only the stitching is serial. Stops
+// handing out files once the finished ones already hold length records.
+vector<pair<uint64_t, uint64_t>> loadCAIDAFiles(const char *pattern, int length, int threads = 0) {
+	vector<string> paths = expandTracePaths(pattern);
+	if (paths.empty()) {
+		printf("%s not found!\n", pattern);
+		exit(-1);
+	}
+	if (threads <= 0)
+		threads = MAX(1u, std::thread::hardware_concurrency());
+	threads = MIN(threads, (int)paths.size());
+	vector<TraceFile> files(paths.size());
+	std::atomic<size_t> next_file(0);
+	std::atomic<uint64_t> known(0);
+	std::atomic<bool> failed(false);
+	vector<std::thread> pool;
+	for (int t = 0; t < threads; ++t) {
+		pool.push_back(std::thread([&]() {
+			while (known.load() < (uint64_t)length) {
+				size_t i = next_file.fetch_add(1);
+				if (i >= paths.size())
+					return;
+				if (!readTraceFile(paths[i].c_str(), files[i])) {
+					printf("%s: %s\n", paths[i].c_str(), strerror(errno));
+					failed = true;
+					return;
+				}
+				known += files[i].known;
+			}
+		}));
+	}
+	for (auto &thread : pool)
+		thread.join();
+	if (failed)
+		exit(-1);
+	files.resize(MIN(next_file.load(), paths.size()));
+	return stitchTraceFiles(files, length);
+}
+
 vector<pair<uint64_t, uint64_t>> loadMAWI(const char *filename, int length) {
 	FILE *pf = fopen(filename, "rb");
 	if (!pf) {
@@ -67,6 +294,56 @@ vector<pair<uint64_t, uint64_t>> loadMAWI(const char *filename, int length) {
 	return dataset;
 }
 
+// CAIDA/MAWI records with the full 13-byte 5-tuple as key instead of its first 8 bytes
+vector<pair<FiveTuple, uint64_t>> load5Tuple(const char *filename, int length) {
+	FILE *pf = fopen(filename, "rb");
+	if (!pf) {
+		printf("%s not found!\n", filename);
+		exit(-1);
+	}
+	map<FiveTuple, uint64_t> last_come;
+	last_come.clear();
+
+	vector<pair<FiveTuple, uint64_t>> dataset;
+	dataset.clear();
+  
+	char trace[30];
+	while (fread(trace, 1, 21, pf)) {
+		FiveTuple tkey((uint8_t *)trace);
+    	uint64_t ttime = *(uint64_t *)(trace + 13);
+		if (last_come.count(tkey))
+    		dataset.push_back(pair<FiveTuple, uint64_t>(tkey, ttime - last_come[tkey]));
+		last_come[tkey] = ttime;
+		if (dataset.size() == length)
+    		break;
+	}
+	fclose(pf);
+	return dataset;
+}
+
+// raw pcap/pcapng capture, same (key, inter-arrival time) records as loadCAIDA
+template<typename ID_TYPE>
+vector<pair<ID_TYPE, uint64_t>> loadPcap(const char *filename, int length) {
+	PcapReader reader(filename);
+	if (!reader.ok()) {
+		printf("%s not found!\n", filename);
+		exit(-1);
+	}
+	map<ID_TYPE, uint64_t> last_come;
+	vector<pair<ID_TYPE, uint64_t>> dataset;
+	ID_TYPE keys[256];
+	uint64_t ts[256];
+	int n;
+	while (dataset.size() < length && (n = reader.next_batch(keys, ts, 256)) > 0) {
+		for (int i = 0; i < n && dataset.size() < length; ++i) {
+			if (last_come.count(keys[i]))
+				dataset.push_back(pair<ID_TYPE, uint64_t>(keys[i], ts[i] - last_come[keys[i]]));
+			last_come[keys[i]] = ts[i];
+		}
+	}
+	return dataset;
+}
+
 vector<pair<uint32_t, uint32_t>> loadWeb(const char *filename, int length) {
 	FILE *pf = fopen(filename, "rb");
 	if (!pf) {
@@ -14,12 +14,92 @@
 
 using namespace std;
 
+// traces; edit to point at the local copies
+#define CAIDA_TRACE "/share/datasets/CAIDA2018/dataset/130100.dat"
+#define MAWI_TRACE "/share/pcap_zhangyd/time07.dat"
+#define WEB_TRACE "/share/datasets/webpage/webdocs_form00.dat"
 
-int main() {
-	vector<pair<uint64_t, uint64_t>> dataset = loadCAIDA("/share/datasets/CAIDA2018/dataset/130100.dat", 20000000);
-	// vector<pair<uint64_t, uint64_t>> dataset = loadMAWI("/share/pcap_zhangyd/time07.dat", 20000000);
-	// vector<pair<uint32_t, uint32_t>> dataset = loadWeb("/share/datasets/webpage/webdocs_form00.dat", 20000000);
-	map<uint64_t, int> ground_truth = get_ground_truth(dataset);
-	run(dataset, ground_truth);
+// benchmarks selected by the first argument; "run" when there is none
+const char* benchmarks[] = {"run", "profile", "front_cache", "huge_pages", "pipeline", "pipeline_profile", "invertible", "adaptive", "hierarchical",
+	"metrics", "delta", "overload", "relocation", "pcap", "heavy_change"};
+
+int main(int argc, char** argv) {
+	string benchmark = argc > 1 ? argv[1] : "run";
+	if (argc > 2 || find(begin(benchmarks), end(benchmarks), benchmark) == end(benchmarks)) {
+		cerr << "usage: " << argv[0] << " [BENCHMARK]\nbenchmarks:";
+		for (const char* name : benchmarks) {
+			cerr << " " << name;
+		}
+		cerr << "\n";
+		return 2;
+	}
+	// these read their own input; front_cache runs on each trace in turn
+	if (benchmark == "front_cache") {
+		{
+			vector<pair<uint64_t, uint64_t>> dataset = loadCAIDA(CAIDA_TRACE, 20000000);
+			run_front_cache(dataset, get_ground_truth(dataset), "caida");
+		}
+		{
+			vector<pair<uint64_t, uint64_t>> dataset = loadMAWI(MAWI_TRACE, 20000000);
+			run_front_cache(dataset, get_ground_truth(dataset), "mawi");
+		}
+		vector<pair<uint32_t, uint32_t>> dataset = loadWeb(WEB_TRACE, 20000000);
+		run_front_cache(dataset, get_ground_truth(dataset), "webdocs");
+		return 0;
+	}
+	if (benchmark == "pcap") {
+		run_pcap<FiveTuple>("/share/pcap/trace.pcap");
+		return 0;
+	}
+	if (benchmark == "heavy_change") {
+		run_heavy_change(loadCAIDATimed(CAIDA_TRACE, 20000000));
+		return 0;
+	}
+
+	vector<pair<uint64_t, uint64_t>> dataset = loadCAIDA(CAIDA_TRACE, 20000000);
+	// vector<pair<uint64_t, uint64_t>> dataset = loadCAIDAFiles("/share/datasets/CAIDA2018/dataset", 20000000);  // every minute file, in parallel
+	// vector<pair<uint64_t, uint64_t>> dataset = loadMAWI(MAWI_TRACE, 20000000);
+	// vector<pair<FiveTuple, uint64_t>> dataset = load5Tuple(CAIDA_TRACE, 20000000);
+	// vector<pair<FiveTuple, uint64_t>> dataset = loadPcap<FiveTuple>("/share/pcap/trace.pcap", 20000000);
+	// vector<pair<uint32_t, uint32_t>> dataset = loadWeb(WEB_TRACE, 20000000);
+	if (benchmark == "hierarchical") {
+		run_hierarchical(dataset);
+		return 0;
+	}
+	if (benchmark == "delta") {
+		run_delta(dataset);
+		return 0;
+	}
+	auto ground_truth = get_ground_truth(dataset);
+	if (benchmark == "run") {
+		run(dataset, ground_truth);
+	}
+	else if (benchmark == "profile") {
+		run(dataset, ground_truth, true);  // with hardware counters
+	}
+	else if (benchmark == "huge_pages") {
+		run_huge_pages(dataset, ground_truth);
+	}
+	else if (benchmark == "pipeline") {
+		run_pipeline(dataset, ground_truth);
+	}
+	else if (benchmark == "pipeline_profile") {
+		run_pipeline(dataset, ground_truth, true);  // hardware counters over both threads
+	}
+	else if (benchmark == "invertible") {
+		run_invertible(dataset, ground_truth);
+	}
+	else if (benchmark == "adaptive") {
+		run_adaptive(dataset, ground_truth);
+	}
+	else if (benchmark == "metrics") {
+		run_metrics(dataset, ground_truth);
+	}
+	else if (benchmark == "overload") {
+		run_overload(dataset, ground_truth);
+	}
+	else if (benchmark == "relocation") {
+		run_relocation(dataset, ground_truth);
+	}
 	return 0;
-}
\ No newline at end of file
+}
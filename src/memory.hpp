@@ -0,0 +1,131 @@
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+// allocations at least this large are mmap'd (and eligible for huge pages)
+#define LARGE_ALLOC_SIZE (1UL << 20)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+struct MemoryPolicy {
+	bool huge_pages = true;
+	// prefer the NUMA node of the allocating thread, or numa_node if >= 0
+	bool numa_local = true;
+	int numa_node = -1;
+};
+
+inline MemoryPolicy& memory_policy() {
+	static MemoryPolicy policy;
+	return policy;
+}
+
+inline size_t large_alloc_length(size_t bytes) {
+	return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+inline void bind_numa(void* addr, size_t length) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+	MemoryPolicy& policy = memory_policy();
+	if (!policy.numa_local) {
+		return;
+	}
+	unsigned cpu = 0, node = 0;
+	if (policy.numa_node >= 0) {
+		node = policy.numa_node;
+	}
+	else if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+		return;
+	}
+	unsigned long mask[4] = {0, 0, 0, 0};
+	if (node >= sizeof(mask) * 8) {
+		return;
+	}
+	mask[node / 64] |= 1UL << (node % 64);
+	// best effort: fails harmlessly on single-node machines and in containers
+	syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+#endif
+}
+
+inline void* large_alloc(size_t bytes) {
+#ifdef __linux__
+	size_t length = large_alloc_length(bytes);
+	if (memory_policy().huge_pages) {
+		// reserved 2 MB pages first, then 2 MB-aligned memory with transparent huge pages
+		void* addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			bind_numa(addr, length);
+			return addr;
+		}
+		addr = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			return NULL;
+		}
+		uintptr_t begin = (uintptr_t)addr, aligned = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		if (aligned > begin) {
+			munmap(addr, aligned - begin);
+		}
+		if (begin + HUGE_PAGE_SIZE > aligned) {
+			munmap((void*)(aligned + length), begin + HUGE_PAGE_SIZE - aligned);
+		}
+		madvise((void*)aligned, length, MADV_HUGEPAGE);
+		bind_numa((void*)aligned, length);
+		return (void*)aligned;
+	}
+	void* addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		return NULL;
+	}
+	bind_numa(addr, length);
+	return addr;
+#else
+	return calloc(1, bytes);
+#endif
+}
+
+// Zeroed storage for num objects of T. Small blocks come from posix_memalign,
+// large ones from mmap so they can use huge pages and NUMA placement.
+template<typename T>
+T* huge_alloc(size_t num) {
+	size_t bytes = num * sizeof(T);
+	void* addr = NULL;
+	if (bytes >= LARGE_ALLOC_SIZE) {
+		addr = large_alloc(bytes);
+	}
+	else if (!posix_memalign(&addr, 64, bytes ? bytes : 1)) {
+		// cache-line aligned so buckets never straddle two lines
+		memset(addr, 0, bytes);
+	}
+	if (!addr) {
+		throw std::bad_alloc();
+	}
+	return (T*)addr;
+}
+
+template<typename T>
+void huge_free(T* addr, size_t num) {
+	if (!addr) {
+		return;
+	}
+	size_t bytes = num * sizeof(T);
+#ifdef __linux__
+	if (bytes >= LARGE_ALLOC_SIZE) {
+		munmap(addr, large_alloc_length(bytes));
+		return;
+	}
+#endif
+	free(addr);
+}
+
+#endif
@@ -0,0 +1,362 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+
+#include "weavesketch.hpp"
+#include "elastic.hpp"
+#include "spacesaving.hpp"
+
+using namespace std;
+
+// Per-component microbenchmarks. Each benchmark reports the best ns/op of
+// MICRO_REPEAT runs over synthetic Zipf keys, at table sizes picked from the
+// cache sizes of this machine.
+//
+//   ./microbench                        print results
+//   ./microbench --save FILE            also write them as a baseline
+//   ./microbench --compare FILE [--threshold 0.1] [--filter NAME]
+//                                       exit 1 if anything got slower than
+//                                       the baseline by more than threshold
+
+#define MICRO_REPEAT 5
+#define MICRO_KEYS (1 << 20)
+// keys per insert_batch() call
+#define MICRO_BATCH 256
+
+vector<uint64_t> keys;
+vector<FiveTuple> tuple_keys;
+volatile uint64_t sink;
+
+void make_keys() {
+	// Zipf(1.0) over 2^20 flows, flow IDs scrambled
+	const int universe = 1 << 20;
+	vector<double> cdf(universe);
+	double sum = 0;
+	for (int i = 0; i < universe; ++i) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+	WyRand random(12345);
+	keys.resize(MICRO_KEYS);
+	tuple_keys.resize(MICRO_KEYS);
+	for (int i = 0; i < MICRO_KEYS; ++i) {
+		double u = (random.next() >> 11) * (1.0 / (1ULL << 53)) * sum;
+		uint64_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+		keys[i] = mix_word(rank + 1);
+		uint8_t bytes[13] = {0};
+		memcpy(bytes, &keys[i], sizeof(uint64_t));
+		bytes[12] = 6;
+		tuple_keys[i] = FiveTuple(bytes);
+	}
+}
+
+uint32_t cache_kb(int name, uint32_t fallback) {
+	long bytes = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+	bytes = sysconf(name);
+#endif
+	return bytes > 0 ? bytes / 1024 : fallback;
+}
+
+// best ns/op of body() over MICRO_REPEAT runs; setup() runs untimed before each
+template<typename S, typename B>
+double measure(uint64_t ops, S setup, B body) {
+	double best = 1e18;
+	for (int r = 0; r < MICRO_REPEAT; ++r) {
+		setup();
+		auto start_time = std::chrono::high_resolution_clock::now();
+		body();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		best = min(best, std::chrono::duration<double, std::nano>(end_time - start_time).count() / ops);
+	}
+	return best;
+}
+
+template<typename B>
+double measure(uint64_t ops, B body) {
+	return measure(ops, []() {}, body);
+}
+
+string filter;
+map<string, double> result;
+
+// runs f() for the benchmark called name unless --filter excludes it
+template<typename F>
+void bench(const string& name, F f) {
+	if (filter.empty() || name.find(filter) != string::npos) {
+		result[name] = f();
+	}
+}
+
+template<typename SKETCH>
+double measure_insert(uint32_t memory, SKETCH* (*create)(uint32_t)) {
+	SKETCH* sketch = NULL;
+	double ns = measure(MICRO_KEYS, [&]() {
+		delete sketch;
+		sketch = create(memory);
+	}, [&]() {
+		for (int i = 0; i < MICRO_KEYS; ++i) {
+			sketch->insert(keys[i], 1);
+		}
+	});
+	delete sketch;
+	return ns;
+}
+
+template<typename SKETCH>
+double measure_query(uint32_t memory, SKETCH* (*create)(uint32_t)) {
+	SKETCH* sketch = create(memory);
+	for (int i = 0; i < MICRO_KEYS; ++i) {
+		sketch->insert(keys[i], 1);
+	}
+	double ns = measure(MICRO_KEYS, [&]() {
+		uint64_t sum = 0;
+		for (int i = 0; i < MICRO_KEYS; ++i) {
+			sum += sketch->query(keys[i]);
+		}
+		sink = sum;
+	});
+	delete sketch;
+	return ns;
+}
+
+template<typename T> T* create_sketch(uint32_t memory) { return new T(memory); }
+template<typename T> T* create_depth_sketch(uint32_t memory) { return new T(memory, 3); }
+
+template<typename DATA_TYPE>
+Sketch<uint64_t>* create_weavesketch(uint32_t memory) {
+	// the initial stages are memory / 2^3; small tables start at full size instead
+	return new WeaveSketch<uint64_t, DATA_TYPE>(memory, 3, memory >= 100 ? 3 : 0, 14, 0.8);
+}
+
+void run_hash() {
+	bench("hash/uint64", [&]() {
+		return measure(MICRO_KEYS, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += ::hash(keys[i], 0);
+			}
+			sink = sum;
+		});
+	});
+	bench("hash/bobhash32_13B", [&]() {
+		return measure(MICRO_KEYS, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += BOBHash::BOBHash32(tuple_keys[i].data(), 13, 0);
+			}
+			sink = sum;
+		});
+	});
+	bench("hash/fivetuple", [&]() {
+		return measure(MICRO_KEYS, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += ::hash(tuple_keys[i], 0);
+			}
+			sink = sum;
+		});
+	});
+}
+
+void run_heavy(const string& size, uint32_t memory) {
+	typedef HeavyPart<uint64_t> HEAVY;
+	HEAVY* heavy = NULL;
+	auto fill = [&]() {
+		delete heavy;
+		heavy = new HEAVY(memory);
+		for (int i = 0; i < MICRO_KEYS; ++i) {
+			heavy->insert_with_replace(keys[i], 1, 0);
+		}
+	};
+	bench("heavy/insert/" + size, [&]() {
+		return measure_insert<HEAVY>(memory, create_sketch<HEAVY>);
+	});
+	bench("heavy/insert_with_replace/" + size, [&]() {
+		return measure(MICRO_KEYS, [&]() {
+			delete heavy;
+			heavy = new HEAVY(memory);
+		}, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += get<1>(heavy->insert_with_replace(keys[i], 1, 0));
+			}
+			sink = sum;
+		});
+	});
+	bench("heavy/query/" + size, [&]() {
+		fill();
+		return measure(MICRO_KEYS, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += get<1>(heavy->query(keys[i]));
+			}
+			sink = sum;
+		});
+	});
+	// per cell of the doubled table
+	uint64_t cells = 2ULL * memory * 1024 / sizeof(Bucket<uint64_t>) * BUCKET_SIZE;
+	bench("heavy/expansion/" + size, [&]() {
+		return measure(cells, fill, [&]() {
+			heavy->expansion();
+		});
+	});
+	delete heavy;
+}
+
+// counter names the light counter type in the benchmark name; empty for int8_t
+template<typename DATA_TYPE>
+void run_light(const string& size, uint32_t memory, const string& counter = "") {
+	typedef LightPart<uint64_t, DATA_TYPE> LIGHT;
+	LIGHT* light = NULL;
+	auto reset = [&]() {
+		delete light;
+		light = new LIGHT(memory, 3);
+	};
+	auto insert = [&]() {
+		for (int i = 0; i < MICRO_KEYS; ++i) {
+			light->insert(keys[i], 1);
+		}
+	};
+	bench("light/insert/" + counter + size, [&]() {
+		return measure(MICRO_KEYS, reset, insert);
+	});
+	bench("light/query/" + counter + size, [&]() {
+		reset();
+		insert();
+		return measure(MICRO_KEYS, [&]() {
+			uint64_t sum = 0;
+			for (int i = 0; i < MICRO_KEYS; ++i) {
+				sum += light->query_error(keys[i]);
+			}
+			sink = sum;
+		});
+	});
+	delete light;
+}
+
+void run_sketches(const string& size, uint32_t memory) {
+	bench("weavesketch/insert/" + size, [&]() { return measure_insert<Sketch<uint64_t>>(memory, create_weavesketch<int8_t>); });
+	bench("weavesketch/insert/int32/" + size, [&]() { return measure_insert<Sketch<uint64_t>>(memory, create_weavesketch<int32_t>); });
+	bench("weavesketch/insert/packed4/" + size, [&]() { return measure_insert<Sketch<uint64_t>>(memory, create_weavesketch<PackedCounter<4>>); });
+	bench("weavesketch/insert/packed6/" + size, [&]() { return measure_insert<Sketch<uint64_t>>(memory, create_weavesketch<PackedCounter<6>>); });
+	bench("weavesketch/query/" + size, [&]() { return measure_query<Sketch<uint64_t>>(memory, create_weavesketch<int8_t>); });
+	bench("cm/insert/" + size, [&]() { return measure_insert<CMSketch<uint64_t, int32_t>>(memory, create_depth_sketch<CMSketch<uint64_t, int32_t>>); });
+	bench("cu/insert/" + size, [&]() { return measure_insert<CUSketch<uint64_t, int32_t>>(memory, create_depth_sketch<CUSketch<uint64_t, int32_t>>); });
+	bench("cu/insert_batch/" + size, [&]() {
+		typedef CUSketch<uint64_t, int32_t> CU;
+		CU* sketch = NULL;
+		vector<int32_t> ones(MICRO_BATCH, 1);
+		double ns = measure(MICRO_KEYS, [&]() {
+			delete sketch;
+			sketch = create_depth_sketch<CU>(memory);
+		}, [&]() {
+			for (int i = 0; i < MICRO_KEYS; i += MICRO_BATCH) {
+				sketch->insert_batch(keys.data() + i, ones.data(), MICRO_BATCH);
+			}
+		});
+		delete sketch;
+		return ns;
+	});
+	bench("count/insert/" + size, [&]() { return measure_insert<CountSketch<uint64_t, int32_t>>(memory, create_depth_sketch<CountSketch<uint64_t, int32_t>>); });
+	bench("elastic/insert/" + size, [&]() { return measure_insert<ElasticSketch<uint64_t>>(memory, create_sketch<ElasticSketch<uint64_t>>); });
+	bench("spacesaving/insert/" + size, [&]() { return measure_insert<SpaceSaving<uint64_t>>(memory, create_sketch<SpaceSaving<uint64_t>>); });
+	bench("uss/insert/" + size, [&]() { return measure_insert<UnbiasedSpaceSaving<uint64_t>>(memory, create_sketch<UnbiasedSpaceSaving<uint64_t>>); });
+	bench("coco/insert/" + size, [&]() { return measure_insert<CocoSketch<uint64_t>>(memory, create_depth_sketch<CocoSketch<uint64_t>>); });
+}
+
+map<string, double> load_baseline(const char* filename) {
+	map<string, double> baseline;
+	ifstream in(filename);
+	if (!in) {
+		cerr << filename << " not found!\n";
+		exit(2);
+	}
+	string name;
+	double ns;
+	while (in >> name >> ns) {
+		baseline[name] = ns;
+	}
+	return baseline;
+}
+
+int main(int argc, char** argv) {
+	const char* save = NULL;
+	const char* compare = NULL;
+	double threshold = 0.1;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--save" && i + 1 < argc) {
+			save = argv[++i];
+		}
+		else if (arg == "--compare" && i + 1 < argc) {
+			compare = argv[++i];
+		}
+		else if (arg == "--threshold" && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+		}
+		else if (arg == "--filter" && i + 1 < argc) {
+			filter = argv[++i];
+		}
+		else {
+			cerr << "usage: " << argv[0] << " [--save FILE] [--compare FILE] [--threshold 0.1] [--filter NAME]\n";
+			return 2;
+		}
+	}
+
+	make_keys();
+	// half of L1, L2 and LLC, and four times LLC (at most 256 MB)
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+	uint32_t l1 = cache_kb(_SC_LEVEL1_DCACHE_SIZE, 32), l2 = cache_kb(_SC_LEVEL2_CACHE_SIZE, 1024), llc = cache_kb(_SC_LEVEL3_CACHE_SIZE, 32768);
+#else
+	uint32_t l1 = 32, l2 = 1024, llc = 32768;
+#endif
+	const string size_name[4] = {"L1", "L2", "LLC", "DRAM"};
+	const uint32_t size_memory[4] = {MAX(l1 / 2, 4u), MAX(l2 / 2, 8u), MAX(llc / 2, 16u), MIN(4 * llc, 256u << 10)};
+
+	run_hash();
+	for (int s = 0; s < 4; ++s) {
+		run_heavy(size_name[s], size_memory[s]);
+		run_light<int8_t>(size_name[s], size_memory[s]);
+		run_light<int32_t>(size_name[s], size_memory[s], "int32/");
+		run_light<PackedCounter<4>>(size_name[s], size_memory[s], "packed4/");
+		run_light<PackedCounter<6>>(size_name[s], size_memory[s], "packed6/");
+		run_sketches(size_name[s], size_memory[s]);
+	}
+
+	map<string, double> baseline;
+	if (compare) {
+		baseline = load_baseline(compare);
+	}
+	int regressions = 0;
+	for (auto& item: result) {
+		cout << item.first << " " << item.second;
+		auto it = baseline.find(item.first);
+		if (it != baseline.end()) {
+			double ratio = item.second / it->second;
+			cout << " " << it->second << " " << ratio;
+			if (ratio > 1 + threshold) {
+				cout << " REGRESSION";
+				regressions++;
+			}
+		}
+		cout << "\n";
+	}
+	if (save) {
+		ofstream out(save);
+		for (auto& item: result) {
+			out << item.first << " " << item.second << "\n";
+		}
+	}
+	if (compare) {
+		cout << regressions << " regression(s) over " << threshold * 100 << "%\n";
+	}
+	return regressions ? 1 : 0;
+}
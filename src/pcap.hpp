@@ -0,0 +1,409 @@
+#ifndef PCAP_H_
+#define PCAP_H_
+
+#include <cstring>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "key.hpp"
+
+using namespace std;
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+// Flow fields of one packet, pointing into the capture: addresses and ports
+// are left in network byte order where they lie.
+struct FlowFields {
+	int version;                 // 4 or 6
+	const uint8_t* src;          // 4 or 16 bytes
+	const uint8_t* dst;
+	const uint8_t* ports;        // sport, dport (4 bytes), NULL if none
+	uint8_t proto;
+};
+
+inline uint16_t read_be16(const uint8_t* p) {
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Ethernet (with up to two VLAN tags) or raw IP, then IPv4/IPv6 and the
+// TCP/UDP ports. Returns false for anything that is not IP or is truncated.
+inline bool parse_flow(const uint8_t* data, uint32_t caplen, int linktype, FlowFields& out) {
+	const uint8_t* end = data + caplen;
+	const uint8_t* p = data;
+	int version = 0;
+	if (linktype == LINKTYPE_ETHERNET) {
+		if (caplen < 14) {
+			return false;
+		}
+		uint16_t type = read_be16(p + 12);
+		p += 14;
+		for (int tags = 0; (type == 0x8100 || type == 0x88a8) && tags < 2; ++tags) {
+			if (p + 4 > end) {
+				return false;
+			}
+			type = read_be16(p + 2);
+			p += 4;
+		}
+		if (type == 0x0800) {
+			version = 4;
+		}
+		else if (type == 0x86dd) {
+			version = 6;
+		}
+		else {
+			return false;
+		}
+	}
+	else if (linktype == LINKTYPE_RAW || linktype == LINKTYPE_IPV4 || linktype == LINKTYPE_IPV6) {
+		if (p >= end) {
+			return false;
+		}
+		version = p[0] >> 4;
+	}
+	else {
+		return false;
+	}
+
+	const uint8_t* l4;
+	bool first_fragment = true;
+	if (version == 4) {
+		if (p + 20 > end || p[0] >> 4 != 4) {
+			return false;
+		}
+		int ihl = (p[0] & 15) * 4;
+		out.proto = p[9];
+		out.src = p + 12;
+		out.dst = p + 16;
+		first_fragment = (read_be16(p + 6) & 0x1fff) == 0;
+		l4 = p + ihl;
+	}
+	else if (version == 6) {
+		if (p + 40 > end) {
+			return false;
+		}
+		out.src = p + 8;
+		out.dst = p + 24;
+		uint8_t next = p[6];
+		l4 = p + 40;
+		// hop-by-hop, routing, fragment and destination options headers
+		while (next == 0 || next == 43 || next == 44 || next == 60) {
+			if (l4 + 8 > end) {
+				return false;
+			}
+			if (next == 44) {
+				first_fragment = (read_be16(l4 + 2) & 0xfff8) == 0;
+				next = l4[0];
+				l4 += 8;
+			}
+			else {
+				next = l4[0];
+				l4 += (l4[1] + 1) * 8;
+			}
+		}
+		out.proto = next;
+	}
+	else {
+		return false;
+	}
+	out.version = version;
+	out.ports = (out.proto == 6 || out.proto == 17) && first_fragment && l4 + 4 <= end ? l4 : NULL;
+	return true;
+}
+
+// How a parsed packet becomes a sketch key. FiveTuple keeps the CAIDA record
+// layout (src, dst, sport, dport, proto) and skips IPv6; FiveTupleV6 stores
+// IPv4 addresses as IPv4-mapped IPv6; uint64_t is (src, dst) like loadCAIDA,
+// using the low 32 bits of IPv6 addresses.
+template<typename ID_TYPE>
+struct PacketKey;
+
+template<>
+struct PacketKey<FiveTuple> {
+	static bool make(const FlowFields& f, FiveTuple& key) {
+		if (f.version != 4) {
+			return false;
+		}
+		uint8_t bytes[13] = {0};
+		memcpy(bytes, f.src, 4);
+		memcpy(bytes + 4, f.dst, 4);
+		if (f.ports) {
+			memcpy(bytes + 8, f.ports, 4);
+		}
+		bytes[12] = f.proto;
+		key = FiveTuple(bytes);
+		return true;
+	}
+};
+
+template<>
+struct PacketKey<FiveTupleV6> {
+	static bool make(const FlowFields& f, FiveTupleV6& key) {
+		uint8_t bytes[37] = {0};
+		if (f.version == 4) {
+			bytes[10] = bytes[11] = bytes[26] = bytes[27] = 0xff;
+			memcpy(bytes + 12, f.src, 4);
+			memcpy(bytes + 28, f.dst, 4);
+		}
+		else {
+			memcpy(bytes, f.src, 16);
+			memcpy(bytes + 16, f.dst, 16);
+		}
+		if (f.ports) {
+			memcpy(bytes + 32, f.ports, 4);
+		}
+		bytes[36] = f.proto;
+		key = FiveTupleV6(bytes);
+		return true;
+	}
+};
+
+template<>
+struct PacketKey<uint64_t> {
+	static bool make(const FlowFields& f, uint64_t& key) {
+		int offset = f.version == 4 ? 0 : 12;
+		memcpy(&key, f.src + offset, 4);
+		memcpy((uint8_t*)&key + 4, f.dst + offset, 4);
+		return true;
+	}
+};
+
+// Memory-mapped pcap (micro- or nanosecond, either byte order) or pcapng
+// capture. Packets are handed out as pointers into the mapping.
+class PcapReader {
+public:
+	struct Packet {
+		const uint8_t* data;
+		uint32_t caplen;
+		uint64_t ts;             // nanoseconds
+		int linktype;
+	};
+
+	PcapReader(const char* filename) {
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			size = st.st_size;
+			void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED) {
+				base = (const uint8_t*)addr;
+				madvise(addr, size, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+		if (base && !read_header()) {
+			munmap((void*)base, size);
+			base = NULL;
+		}
+	}
+
+	~PcapReader() {
+		if (base) {
+			munmap((void*)base, size);
+		}
+	}
+
+	bool ok() const {
+		return base != NULL;
+	}
+
+	bool next(Packet& packet) {
+		return pcapng ? next_pcapng(packet) : next_pcap(packet);
+	}
+
+	// up to n keys (and timestamps) of parsable packets; 0 at the end of the capture
+	template<typename ID_TYPE>
+	int next_batch(ID_TYPE* keys, uint64_t* ts, int n) {
+		Packet packet;
+		FlowFields fields;
+		int count = 0;
+		while (count < n && next(packet)) {
+			packets++;
+			if (parse_flow(packet.data, packet.caplen, packet.linktype, fields) && PacketKey<ID_TYPE>::make(fields, keys[count])) {
+				ts[count++] = packet.ts;
+			}
+		}
+		return count;
+	}
+
+	// packets read so far, parsable or not
+	uint64_t packet_count() const {
+		return packets;
+	}
+
+	void rewind() {
+		pos = start;
+		packets = 0;
+		if (pcapng) {
+			interfaces.clear();
+		}
+	}
+
+private:
+	struct Interface {
+		int linktype;
+		uint64_t ts_num, ts_den;   // ns = ticks * ts_num / ts_den
+	};
+
+	uint32_t get32(const uint8_t* p) const {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return swapped ? __builtin_bswap32(v) : v;
+	}
+
+	uint16_t get16(const uint8_t* p) const {
+		uint16_t v;
+		memcpy(&v, p, 2);
+		return swapped ? __builtin_bswap16(v) : v;
+	}
+
+	bool read_header() {
+		if (size < 24) {
+			return false;
+		}
+		uint32_t magic;
+		memcpy(&magic, base, 4);
+		if (magic == 0x0a0d0d0a) {
+			pcapng = true;
+			pos = start = 0;
+			return true;
+		}
+		if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+			swapped = false;
+		}
+		else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+			swapped = true;
+		}
+		else {
+			return false;
+		}
+		nanosecond = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+		linktype = get32(base + 20) & 0xffff;
+		pos = start = 24;
+		return true;
+	}
+
+	bool next_pcap(Packet& packet) {
+		if (pos + 16 > size) {
+			return false;
+		}
+		const uint8_t* record = base + pos;
+		uint32_t caplen = get32(record + 8);
+		if (pos + 16 + caplen > size) {
+			return false;
+		}
+		packet.data = record + 16;
+		packet.caplen = caplen;
+		packet.ts = (uint64_t)get32(record) * 1000000000 + (uint64_t)get32(record + 4) * (nanosecond ? 1 : 1000);
+		packet.linktype = linktype;
+		pos += 16 + caplen;
+		return true;
+	}
+
+	bool next_pcapng(Packet& packet) {
+		while (pos + 12 <= size) {
+			const uint8_t* block = base + pos;
+			uint32_t type;
+			memcpy(&type, block, 4);
+			if (type == 0x0a0d0d0a) {
+				// section header: byte order of the section, its interfaces start over
+				uint32_t order;
+				memcpy(&order, block + 8, 4);
+				swapped = order != 0x1a2b3c4d;
+				interfaces.clear();
+			}
+			else if (swapped) {
+				type = __builtin_bswap32(type);
+			}
+			uint32_t length = get32(block + 4);
+			if (length < 12 || pos + length > size) {
+				return false;
+			}
+			pos += length;
+			if (type == 1 && length >= 20) {
+				add_interface(block, length);
+			}
+			else if (type == 6 && length >= 32) {
+				uint32_t id = get32(block + 8);
+				if (id >= interfaces.size()) {
+					continue;
+				}
+				uint32_t caplen = get32(block + 20);
+				// the data ends before the trailing length; length >= 32, so this cannot wrap
+				if (caplen > length - 32) {
+					continue;
+				}
+				uint64_t ticks = (uint64_t)get32(block + 12) << 32 | get32(block + 16);
+				packet.data = block + 28;
+				packet.caplen = caplen;
+				packet.ts = to_ns(ticks, interfaces[id]);
+				packet.linktype = interfaces[id].linktype;
+				return true;
+			}
+			else if (type == 3 && length >= 16 && !interfaces.empty()) {
+				packet.data = block + 12;
+				packet.caplen = MIN(get32(block + 8), length - 16);
+				packet.ts = 0;
+				packet.linktype = interfaces[0].linktype;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void add_interface(const uint8_t* block, uint32_t length) {
+		Interface interface = {get16(block + 8), 1000, 1};
+		// options: if_tsresol (code 9) changes the default microsecond ticks
+		for (uint32_t offset = 16; offset + 4 <= length - 4;) {
+			uint16_t code = get16(block + offset), option_length = get16(block + offset + 2);
+			if (code == 0) {
+				break;
+			}
+			if (code == 9 && option_length >= 1) {
+				uint8_t resolution = block[offset + 4];
+				uint64_t scale = 1;
+				if (resolution & 0x80) {
+					for (int i = 0; i < (resolution & 0x7f) && i < 63; ++i) {
+						scale <<= 1;
+					}
+					interface.ts_num = 1000000000;
+					interface.ts_den = scale;
+				}
+				else {
+					for (int i = 0; i < resolution && i < 19; ++i) {
+						scale *= 10;
+					}
+					interface.ts_num = scale >= 1000000000 ? 1 : 1000000000 / scale;
+					interface.ts_den = scale >= 1000000000 ? scale / 1000000000 : 1;
+				}
+			}
+			offset += 4 + (option_length + 3) / 4 * 4;
+		}
+		interfaces.push_back(interface);
+	}
+
+	static uint64_t to_ns(uint64_t ticks, const Interface& interface) {
+		if (interface.ts_den == 1) {
+			return ticks * interface.ts_num;
+		}
+		return (uint64_t)((__uint128_t)ticks * interface.ts_num / interface.ts_den);
+	}
+
+	const uint8_t* base = NULL;
+	size_t size = 0, pos = 0, start = 0;
+	bool pcapng = false, swapped = false, nanosecond = false;
+	int linktype = LINKTYPE_ETHERNET;
+	vector<Interface> interfaces;
+	uint64_t packets = 0;
+};
+
+#endif
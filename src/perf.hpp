@@ -0,0 +1,130 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <cstring>
+#include <iostream>
+#include <stdint.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define PERF_EVENT_NUM 6
+#define PERF_DTLB_MISS 5
+
+static const char* perf_event_name[PERF_EVENT_NUM] = {"cycles", "instructions", "L1D-miss", "LLC-miss", "branch-miss", "dTLB-miss"};
+
+// Hardware counters around a measured region, one perf_event fd per event.
+// They count the constructing thread and every thread it starts afterwards
+// (inherit), e.g. the light thread of a WeaveSketch pipelined after this.
+// Events that cannot be opened (no PMU, perf_event_paranoid, containers)
+// are reported as n/a; the rest keep working.
+class PerfCounters {
+public:
+	PerfCounters() {
+		memset(value, 0, sizeof(value));
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			fd[i] = -1;
+		}
+#ifdef __linux__
+		const uint64_t cache_read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		const uint32_t type[PERF_EVENT_NUM] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+		const uint64_t config[PERF_EVENT_NUM] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | cache_read_miss,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | cache_read_miss,
+		};
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = type[i];
+			attr.config = config[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.inherit = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	}
+
+	~PerfCounters() {
+#ifdef __linux__
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			if (fd[i] >= 0) {
+				close(fd[i]);
+			}
+		}
+#endif
+	}
+
+	bool available() const {
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			if (fd[i] >= 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void start() {
+#ifdef __linux__
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			if (fd[i] >= 0) {
+				ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	void stop() {
+#ifdef __linux__
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			if (fd[i] < 0) {
+				continue;
+			}
+			ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			// count, time enabled, time running; scale up if the event was multiplexed
+			uint64_t data[3] = {0, 0, 0};
+			if (read(fd[i], data, sizeof(data)) != sizeof(data)) {
+				value[i] = -1;
+				continue;
+			}
+			value[i] = data[2] ? 1.0 * data[0] * data[1] / data[2] : 0;
+		}
+#endif
+	}
+
+	// prints "<label> cycles=... instructions=... ..." normalized per operation
+	void print(const char* label, uint64_t ops) const {
+		std::cout << label;
+		for (int i = 0; i < PERF_EVENT_NUM; ++i) {
+			std::cout << " " << perf_event_name[i] << "=";
+			if (fd[i] < 0 || value[i] < 0) {
+				std::cout << "n/a";
+			}
+			else {
+				std::cout << value[i] / ops;
+			}
+		}
+		std::cout << "\n";
+	}
+
+	double get(int event) const {
+		return fd[event] >= 0 ? value[event] : -1;
+	}
+
+private:
+	int fd[PERF_EVENT_NUM];
+	double value[PERF_EVENT_NUM];
+};
+
+#endif
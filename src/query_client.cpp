@@ -0,0 +1,154 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "key.hpp"
+#include "load_dataset.hpp"
+#include "query_protocol.hpp"
+
+using namespace std;
+
+// Load generator for query_server: each connection sends one request at a
+// time and waits for its response, for a fixed duration.
+//
+//   ./query_client SOCKET [--connections 4] [--seconds 5] [--batch 64] [--topk K] [--sketch 0] [--trace FILE]
+//
+// --batch 1 sends point queries, --topk K top-k requests instead of keys.
+// Keys come from the CAIDA trace when given, else from 2^20 synthetic IDs.
+// Prints requests, QPS, keys/s and the p50/p99/max latency in microseconds.
+
+int connect_unix(const char* path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " SOCKET [--connections 4] [--seconds 5] [--batch 64] [--topk K] [--sketch 0] [--trace FILE]\n";
+		return 2;
+	}
+	const char* socket_path = argv[1];
+	const char* trace = NULL;
+	int connections = 4, batch = 64, topk = 0, sketch = 0;
+	double seconds = 5;
+	for (int i = 2; i < argc; ++i) {
+		string arg = argv[i];
+		if (i + 1 >= argc) {
+			cerr << "missing value for " << arg << "\n";
+			return 2;
+		}
+		if (arg == "--connections") {
+			connections = atoi(argv[++i]);
+		}
+		else if (arg == "--seconds") {
+			seconds = atof(argv[++i]);
+		}
+		else if (arg == "--batch") {
+			batch = atoi(argv[++i]);
+			batch = MIN(MAX(batch, 1), QUERY_MAX_KEYS);
+		}
+		else if (arg == "--topk") {
+			topk = atoi(argv[++i]);
+			topk = MIN(topk, QUERY_MAX_KEYS);
+		}
+		else if (arg == "--sketch") {
+			sketch = atoi(argv[++i]);
+		}
+		else if (arg == "--trace") {
+			trace = argv[++i];
+		}
+		else {
+			cerr << "unknown option " << arg << "\n";
+			return 2;
+		}
+	}
+
+	vector<uint64_t> keys;
+	if (trace) {
+		for (auto& p: loadCAIDA(trace, 1 << 22)) {
+			keys.push_back(p.first);
+		}
+	}
+	else {
+		for (uint64_t i = 0; i < (1 << 20); ++i) {
+			keys.push_back(mix_word(i + 1));
+		}
+	}
+
+	vector<vector<double>> latency(connections);
+	vector<uint64_t> failures(connections, 0);
+	vector<thread> threads;
+	auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+	auto start_time = chrono::steady_clock::now();
+	for (int t = 0; t < connections; ++t) {
+		threads.emplace_back([&, t]() {
+			int fd = connect_unix(socket_path);
+			if (fd < 0) {
+				failures[t]++;
+				return;
+			}
+			vector<char> request(QUERY_MAX_REQUEST), response(QUERY_MAX_RESPONSE);
+			QueryRequest header = {(uint8_t)(topk ? QUERY_OP_TOPK : batch == 1 ? QUERY_OP_POINT : QUERY_OP_BATCH), (uint8_t)sketch, 0, (uint32_t)(topk ? topk : batch)};
+			size_t key_bytes = topk ? 0 : batch * sizeof(uint64_t);
+			size_t position = (size_t)t * keys.size() / connections;
+			latency[t].reserve(1 << 20);
+			while (chrono::steady_clock::now() < deadline) {
+				memcpy(request.data(), &header, sizeof(header));
+				for (size_t k = 0; k < key_bytes / sizeof(uint64_t); ++k) {
+					memcpy(request.data() + sizeof(header) + k * sizeof(uint64_t), &keys[position], sizeof(uint64_t));
+					position = position + 1 == keys.size() ? 0 : position + 1;
+				}
+				auto send_time = chrono::steady_clock::now();
+				QueryResponse result;
+				if (!write_full(fd, request.data(), sizeof(header) + key_bytes) || !read_full(fd, &result, sizeof(result))
+					|| !read_full(fd, response.data(), result.count * (topk ? sizeof(QueryTopEntry) : sizeof(int32_t)))) {
+					failures[t]++;
+					break;
+				}
+				if (result.status != QUERY_OK) {
+					failures[t]++;
+					break;
+				}
+				latency[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - send_time).count());
+			}
+			close(fd);
+		});
+	}
+	for (auto& t: threads) {
+		t.join();
+	}
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+
+	vector<double> all;
+	uint64_t failed = 0;
+	for (int t = 0; t < connections; ++t) {
+		all.insert(all.end(), latency[t].begin(), latency[t].end());
+		failed += failures[t];
+	}
+	if (all.empty()) {
+		cerr << "no request completed (" << failed << " failed)\n";
+		return 1;
+	}
+	sort(all.begin(), all.end());
+	double qps = all.size() / elapsed;
+	cout << "requests " << all.size() << " failed " << failed << "\n";
+	cout << "qps " << qps << " keys/s " << (topk ? 0 : qps * batch) << "\n";
+	cout << "latency_us p50 " << all[all.size() / 2] << " p99 " << all[all.size() * 99 / 100] << " max " << all.back() << "\n";
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#ifndef QUERY_PROTOCOL_H_
+#define QUERY_PROTOCOL_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Binary protocol of query_server, host byte order over a Unix domain
+// socket. A connection carries any number of requests back to back, each
+// answered in order by one response.
+//
+//   request:  QueryRequest, then count uint64_t keys (point: 1, top-k: none)
+//   response: QueryResponse, then count int32_t estimates (point, batch)
+//             or count QueryTopEntry, largest first (top-k)
+
+#define QUERY_OP_POINT 1
+#define QUERY_OP_BATCH 2
+#define QUERY_OP_TOPK 3
+
+// keys of a batch request, and the largest k of a top-k request
+#define QUERY_MAX_KEYS 4096
+
+#define QUERY_OK 0
+#define QUERY_BAD_REQUEST 1    // the server closes the connection after this
+#define QUERY_NO_SKETCH 2
+
+struct QueryRequest {
+	uint8_t op;
+	uint8_t sketch;       // index in the order the server was given its sketches
+	uint16_t reserved;
+	uint32_t count;       // keys, or k for top-k
+};
+
+struct QueryResponse {
+	uint32_t status;
+	uint32_t count;
+};
+
+struct QueryTopEntry {
+	uint64_t key;
+	int32_t estimate;
+	uint32_t reserved;
+};
+
+#define QUERY_MAX_REQUEST (sizeof(QueryRequest) + QUERY_MAX_KEYS * sizeof(uint64_t))
+#define QUERY_MAX_RESPONSE (sizeof(QueryResponse) + QUERY_MAX_KEYS * sizeof(QueryTopEntry))
+
+// blocking helpers for clients: false on error or end of stream
+inline bool write_full(int fd, const void* data, size_t n) {
+	const char* p = (const char*)data;
+	while (n) {
+		ssize_t k = write(fd, p, n);
+		if (k < 0 && errno == EINTR) {
+			continue;
+		}
+		if (k <= 0) {
+			return false;
+		}
+		p += k;
+		n -= k;
+	}
+	return true;
+}
+
+inline bool read_full(int fd, void* data, size_t n) {
+	char* p = (char*)data;
+	while (n) {
+		ssize_t k = read(fd, p, n);
+		if (k < 0 && errno == EINTR) {
+			continue;
+		}
+		if (k <= 0) {
+			return false;
+		}
+		p += k;
+		n -= k;
+	}
+	return true;
+}
+
+#endif
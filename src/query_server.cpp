@@ -0,0 +1,281 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "weavesketch.hpp"
+#include "load_dataset.hpp"
+#include "query_protocol.hpp"
+
+using namespace std;
+
+// Serves WeaveSketch<uint64_t> instances over a Unix domain socket with the
+// protocol of query_protocol.hpp, from a single epoll loop.
+//
+//   ./query_server SOCKET [--snapshot FILE]... [--trace FILE [--packets N] [--memory KB] [--save FILE]]
+//
+// Sketch ids follow the order of the options. A --snapshot sketch is served
+// as saved; the --trace sketch is live: the CAIDA trace is inserted in
+// slices between requests, and the sketch is written to --save once the
+// whole trace is in.
+
+#define SERVER_MAX_EVENTS 64
+// packets inserted into the live sketch per loop iteration
+#define INGEST_SLICE 65536
+
+typedef WeaveSketch<uint64_t> SKETCH;
+
+// Request and response buffers are allocated once per connection; requests
+// are answered in place.
+struct Connection {
+	int fd;
+	alignas(8) char in[QUERY_MAX_REQUEST];
+	alignas(8) char out[QUERY_MAX_RESPONSE];
+	size_t in_len = 0, out_len = 0, out_sent = 0;
+	bool closing = false;
+};
+
+vector<SKETCH*> sketches;
+vector<QueryTopEntry> top;
+
+bool top_greater(const QueryTopEntry& a, const QueryTopEntry& b) {
+	return a.estimate > b.estimate;
+}
+
+// fills c.out with the response to the request at the front of c.in
+void answer(Connection& c, const QueryRequest& request) {
+	QueryResponse* response = (QueryResponse*)c.out;
+	char* payload = c.out + sizeof(QueryResponse);
+	response->count = 0;
+	c.out_len = sizeof(QueryResponse);
+	if (request.sketch >= sketches.size()) {
+		response->status = QUERY_NO_SKETCH;
+		return;
+	}
+	SKETCH* sketch = sketches[request.sketch];
+	response->status = QUERY_OK;
+	if (request.op == QUERY_OP_TOPK) {
+		// min-heap of the k largest heavy-part estimates
+		top.clear();
+		sketch->for_each_heavy([&](const uint64_t& key, int32_t estimate) {
+			if (top.size() < request.count) {
+				top.push_back(QueryTopEntry{key, estimate, 0});
+				push_heap(top.begin(), top.end(), top_greater);
+			}
+			else if (request.count && estimate > top.front().estimate) {
+				pop_heap(top.begin(), top.end(), top_greater);
+				top.back() = QueryTopEntry{key, estimate, 0};
+				push_heap(top.begin(), top.end(), top_greater);
+			}
+		});
+		sort_heap(top.begin(), top.end(), top_greater);
+		memcpy(payload, top.data(), top.size() * sizeof(QueryTopEntry));
+		response->count = top.size();
+		c.out_len += top.size() * sizeof(QueryTopEntry);
+		return;
+	}
+	// point queries take the batch path with one key
+	const uint64_t* keys = (const uint64_t*)(c.in + sizeof(QueryRequest));
+	sketch->query_batch(keys, request.count, (int32_t*)payload);
+	response->count = request.count;
+	c.out_len += request.count * sizeof(int32_t);
+}
+
+// answers every complete request in c.in while the previous response is out
+void process(Connection& c) {
+	while (!c.out_len && !c.closing && c.in_len >= sizeof(QueryRequest)) {
+		QueryRequest request;
+		memcpy(&request, c.in, sizeof(request));
+		bool valid = (request.op == QUERY_OP_POINT && request.count == 1)
+			|| (request.op == QUERY_OP_BATCH && request.count <= QUERY_MAX_KEYS)
+			|| (request.op == QUERY_OP_TOPK && request.count <= QUERY_MAX_KEYS);
+		if (!valid) {
+			QueryResponse response = {QUERY_BAD_REQUEST, 0};
+			memcpy(c.out, &response, sizeof(response));
+			c.out_len = sizeof(response);
+			c.closing = true;
+			return;
+		}
+		size_t length = sizeof(QueryRequest) + (request.op == QUERY_OP_TOPK ? 0 : request.count * sizeof(uint64_t));
+		if (c.in_len < length) {
+			return;
+		}
+		answer(c, request);
+		memmove(c.in, c.in + length, c.in_len - length);
+		c.in_len -= length;
+		ssize_t k = write(c.fd, c.out, c.out_len);
+		if (k > 0) {
+			c.out_sent = k;
+		}
+		if (c.out_sent == c.out_len) {
+			c.out_len = c.out_sent = 0;
+		}
+	}
+}
+
+bool flush_output(Connection& c) {
+	while (c.out_sent < c.out_len) {
+		ssize_t k = write(c.fd, c.out + c.out_sent, c.out_len - c.out_sent);
+		if (k < 0 && errno == EINTR) {
+			continue;
+		}
+		if (k <= 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c.out_sent += k;
+	}
+	c.out_len = c.out_sent = 0;
+	return true;
+}
+
+int listen_unix(const char* path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " SOCKET [--snapshot FILE]... [--trace FILE [--packets N] [--memory KB] [--save FILE]]\n";
+		return 2;
+	}
+	const char* socket_path = argv[1];
+	const char* trace = NULL;
+	const char* save = NULL;
+	int packets = 20000000, memory = 1000;
+	int live = -1;
+	for (int i = 2; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--snapshot" && i + 1 < argc) {
+			ifstream in(argv[++i], ios::binary);
+			SKETCH* sketch = new SKETCH();
+			if (!in || !sketch->load(in)) {
+				cerr << argv[i] << ": not a snapshot\n";
+				return 1;
+			}
+			sketches.push_back(sketch);
+		}
+		else if (arg == "--trace" && i + 1 < argc && live < 0) {
+			trace = argv[++i];
+			live = sketches.size();
+			sketches.push_back(NULL);
+		}
+		else if (arg == "--packets" && i + 1 < argc) {
+			packets = atoi(argv[++i]);
+		}
+		else if (arg == "--memory" && i + 1 < argc) {
+			memory = atoi(argv[++i]);
+		}
+		else if (arg == "--save" && i + 1 < argc) {
+			save = argv[++i];
+		}
+		else {
+			cerr << "unknown option " << arg << "\n";
+			return 2;
+		}
+	}
+	vector<pair<uint64_t, uint64_t>> dataset;
+	size_t ingested = 0;
+	if (trace) {
+		dataset = loadCAIDA(trace, packets);
+		sketches[live] = new SKETCH(memory, 3, 3, 14, 0.8);
+	}
+	if (sketches.empty()) {
+		cerr << "nothing to serve\n";
+		return 2;
+	}
+	top.reserve(QUERY_MAX_KEYS);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listen_fd = listen_unix(socket_path);
+	int epoll_fd = epoll_create1(0);
+	if (listen_fd < 0 || epoll_fd < 0) {
+		perror(socket_path);
+		return 1;
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+	cout << "serving " << sketches.size() << " sketch(es) on " << socket_path << endl;
+
+	epoll_event events[SERVER_MAX_EVENTS];
+	while (true) {
+		// poll without blocking while the live sketch is still being filled
+		bool ingesting = ingested < dataset.size();
+		int n = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, ingesting ? 0 : -1);
+		for (int e = 0; e < n; ++e) {
+			Connection* c = (Connection*)events[e].data.ptr;
+			if (!c) {
+				int fd;
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+					c = new Connection();
+					c->fd = fd;
+					epoll_event add = {};
+					add.events = EPOLLIN;
+					add.data.ptr = c;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &add);
+				}
+				continue;
+			}
+			bool ok = true;
+			if (events[e].events & EPOLLOUT) {
+				ok = flush_output(*c);
+			}
+			if (ok && (events[e].events & EPOLLIN) && !c->out_len) {
+				ssize_t k = read(c->fd, c->in + c->in_len, QUERY_MAX_REQUEST - c->in_len);
+				ok = k > 0 || (k < 0 && (errno == EAGAIN || errno == EINTR));
+				c->in_len += MAX(k, (ssize_t)0);
+			}
+			else if (events[e].events & (EPOLLHUP | EPOLLERR)) {
+				ok = false;
+			}
+			if (ok) {
+				process(*c);
+			}
+			if (!ok || (c->closing && !c->out_len)) {
+				close(c->fd);
+				delete c;
+				continue;
+			}
+			// wait for the socket to drain before reading further requests
+			epoll_event mod = {};
+			mod.events = c->out_len ? EPOLLOUT : EPOLLIN;
+			mod.data.ptr = c;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &mod);
+		}
+		if (ingesting) {
+			size_t end = MIN(dataset.size(), ingested + INGEST_SLICE);
+			for (; ingested < end; ++ingested) {
+				sketches[live]->insert(dataset[ingested].first, 1);
+			}
+			if (ingested == dataset.size()) {
+				cout << "live sketch: " << ingested << " packets" << endl;
+				if (save) {
+					ofstream out(save, ios::binary);
+					sketches[live]->save(out);
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+// Bounded single-producer single-consumer queue. Each side keeps a cached
+// copy of the other side's index on its own cache line, so the shared
+// indices are only re-read when the queue looks full (or empty).
+template<typename T>
+class SPSCRing {
+public:
+	SPSCRing(uint32_t capacity): head(0), tail_cache(0), tail(0), head_cache(0) {
+		size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		buffer.resize(size);
+	}
+
+	// producer side
+	bool push(const T& item) {
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		if (t - head_cache == size) {
+			head_cache = head.load(std::memory_order_acquire);
+			if (t - head_cache == size) {
+				return false;
+			}
+		}
+		buffer[t & (size - 1)] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side
+	bool pop(T& item) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		if (h == tail_cache) {
+			tail_cache = tail.load(std::memory_order_acquire);
+			if (h == tail_cache) {
+				return false;
+			}
+		}
+		item = buffer[h & (size - 1)];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	alignas(64) std::atomic<uint64_t> head;
+	uint64_t tail_cache;
+	alignas(64) std::atomic<uint64_t> tail;
+	uint64_t head_cache;
+	alignas(64) std::vector<T> buffer;
+	uint64_t size;
+};
+
+#endif
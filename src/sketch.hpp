@@ -9,7 +9,12 @@
 #include <random>
 #include <stdexcept>
 #include <stdint.h>
+#include <vector>
 #include "hash.hpp"
+#include "counter.hpp"
+#include "snapshot.hpp"
+
+#define MAX_DEPTH 16
 
 const int count_sketch_sign[2] = {-1, 1};
 
@@ -26,33 +31,43 @@ template<typename ID_TYPE, typename DATA_TYPE>
 class CMSketch : public Sketch<ID_TYPE> {
 public:
 	CMSketch(int memory, int _d): d(_d) {
-		w = memory * 1024 / sizeof(DATA_TYPE) / d;
-		counter = new DATA_TYPE* [d];
+		assert(d <= MAX_DEPTH);
+		w = COUNTER::width(memory, d);
+		counter = new COUNTER [d];
 		for (int i = 0; i < d; ++i) {
-			counter[i] = new DATA_TYPE [w];
-			memset(counter[i], 0, w * sizeof(DATA_TYPE));
+			counter[i].init(w);
 		}
 	}
 
 	~CMSketch() {
-		for (int i = 0; i < d; ++i) {
-			delete[] counter[i];
-		}
 		delete[] counter;
 	}
 
 	void insert(ID_TYPE key, int32_t value) {
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
-			counter[i][index] += value;
+			counter[i].add(index, value);
+		}
+	}
+
+	// insert, and return the largest counter of key afterwards as it would
+	// be without wrapping
+	int64_t insert_peak(ID_TYPE key, int32_t value) {
+		int64_t peak = 0;
+		for (int i = 0; i < d; ++i) {
+			uint32_t index = ::hash(key, 33 + i) % w;
+			int64_t updated = (int64_t)counter[i].get(index) + value;
+			counter[i].add(index, value);
+			peak = MAX(peak, updated);
 		}
+		return peak;
 	}
 
 	int32_t query(ID_TYPE key) {
 		int32_t min_value = 1e9;
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
-			min_value = MIN(counter[i][index], min_value);
+			min_value = MIN(counter[i].get(index), min_value);
 		}
 		return min_value;
 	}
@@ -61,56 +76,150 @@ public:
 		int32_t max_value = 0;
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
-			max_value = MAX(counter[i][index], max_value);
+			max_value = MAX(counter[i].get(index), max_value);
 		}
 		return max_value;
 	}
+
+	static int32_t counter_limit() {
+		return COUNTER::limit();
+	}
+
+	// f(value) for every counter of the first row, decoded in chunks by the
+	// policy's bulk load()
+	template<typename F>
+	void for_each_counter(F f) const {
+		int32_t chunk[256];
+		for (int begin = 0; begin < w; begin += 256) {
+			int n = w - begin < 256 ? w - begin : 256;
+			counter[0].load(begin, n, chunk);
+			for (int k = 0; k < n; ++k) {
+				f(chunk[k]);
+			}
+		}
+	}
+
+	// doubles the width and keeps every estimate (see widen_rows)
+	void widen() {
+		widen_rows(counter, d, w);
+	}
+
+	// halves the width of rows that were never widened, returning the largest
+	// counter afterwards as it would be without wrapping (see fold_rows)
+	int64_t narrow() {
+		return fold_rows(counter, d, w);
+	}
+
+	bool narrowable() const {
+		return w % 2 == 0 && w >= 2;
+	}
+
+	void save(std::ostream& out) const {
+		write_value(out, d);
+		write_value(out, w);
+		for (int i = 0; i < d; ++i) {
+			write_counters(out, counter[i], w);
+		}
+	}
+
+	// replaces the rows with the ones from save() of a sketch of at most memory KB
+	bool load(std::istream& in, int memory) {
+		int new_d, new_w;
+		if (!read_value(in, new_d) || !read_value(in, new_w) || new_d <= 0 || new_d > MAX_DEPTH || new_w < 0
+			|| new_d * COUNTER::row_bytes(new_w) > (uint64_t)memory * 1024) {
+			return false;
+		}
+		delete[] counter;
+		d = new_d;
+		w = new_w;
+		counter = new COUNTER [d];
+		for (int i = 0; i < d; ++i) {
+			counter[i].init(w);
+			if (!read_counters(in, counter[i], w)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 	double calculate_memory() {
-		return d * w * sizeof(DATA_TYPE) / 1024.0;
+		double memory = 0;
+		for (int i = 0; i < d; ++i) {
+			memory += counter[i].calculate_memory();
+		}
+		return memory;
 	}
 	void print_info() {
 		for(int i = 0; i < d; ++i) {
 			for (int j = 0; j < w; ++j) {
-				std::cout << (int)(counter[i][j]) << " ";
+				std::cout << counter[i].get(j) << " ";
 			}
 			std::cout << "\n";
 		}
 	}
 private:
+	typedef typename CounterPolicy<DATA_TYPE>::type COUNTER;
 	int d, w;
-	DATA_TYPE** counter;
+	COUNTER* counter;
 };
 
 template<typename ID_TYPE, typename DATA_TYPE>
 class CUSketch : public Sketch<ID_TYPE> {
 public:
 	CUSketch(int memory, int _d): d(_d) {
-		w = memory * 1024 / sizeof(DATA_TYPE) / d;
-		counter = new DATA_TYPE* [d];
+		assert(d <= MAX_DEPTH);
+		w = COUNTER::width(memory, d);
+		counter = new COUNTER [d];
 		for (int i = 0; i < d; ++i) {
-			counter[i] = new DATA_TYPE [w];
-			memset(counter[i], 0, w * sizeof(DATA_TYPE));
+			counter[i].init(w);
 		}
 	}
 
 	~CUSketch() {
-		for (int i = 0; i < d; ++i) {
-			delete[] counter[i];
-		}
 		delete[] counter;
 	}
 
 	void insert(ID_TYPE key, int32_t value) {
-		int32_t min_value = 1e9;
+		uint32_t index[MAX_DEPTH];
 		for (int i = 0; i < d; ++i) {
-			uint32_t index = ::hash(key, 33 + i) % w;
-			min_value = MIN(min_value, counter[i][index]);
+			index[i] = ::hash(key, 33 + i) % w;
 		}
-		for (int i = 0; i < d; ++i) {
-			uint32_t index = ::hash(key, 33 + i) % w;
-			if (counter[i][index] <= min_value + value) {
-				counter[i][index] = min_value + value;
+		update(index, value);
+	}
+
+	// Combines repeated keys inside the batch first, so a burst of the same
+	// flow costs one conservative update instead of one per occurrence.
+	void insert_batch(const ID_TYPE* keys, const int32_t* values, int n) {
+		uint32_t slot_num = 1;
+		while (slot_num < 2 * (uint32_t)n) {
+			slot_num <<= 1;
+		}
+		batch_slot.assign(slot_num, -1);
+		batch_key.clear();
+		batch_value.clear();
+		batch_hash.clear();
+		for (int k = 0; k < n; ++k) {
+			uint32_t h = ::hash(keys[k], 33);
+			uint32_t slot = h & (slot_num - 1);
+			while (batch_slot[slot] >= 0 && !(batch_key[batch_slot[slot]] == keys[k])) {
+				slot = (slot + 1) & (slot_num - 1);
+			}
+			if (batch_slot[slot] >= 0) {
+				batch_value[batch_slot[slot]] += values[k];
+				continue;
 			}
+			batch_slot[slot] = batch_key.size();
+			batch_key.push_back(keys[k]);
+			batch_value.push_back(values[k]);
+			batch_hash.push_back(h);
+		}
+		uint32_t index[MAX_DEPTH];
+		for (size_t k = 0; k < batch_key.size(); ++k) {
+			index[0] = batch_hash[k] % w;
+			for (int i = 1; i < d; ++i) {
+				index[i] = ::hash(batch_key[k], 33 + i) % w;
+			}
+			update(index, batch_value[k]);
 		}
 	}
 
@@ -118,7 +227,7 @@ public:
 		int32_t min_value = 1e9;
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
-			min_value = MIN(counter[i][index], min_value);
+			min_value = MIN(counter[i].get(index), min_value);
 		}
 		return min_value;
 	}
@@ -127,42 +236,64 @@ public:
 		int32_t max_value = 0;
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
-			max_value = MAX(counter[i][index], max_value);
+			max_value = MAX(counter[i].get(index), max_value);
 		}
 		return max_value;
 	}
 	double calculate_memory() {
-		return d * w * sizeof(DATA_TYPE) / 1024.0;
+		double memory = 0;
+		for (int i = 0; i < d; ++i) {
+			memory += counter[i].calculate_memory();
+		}
+		return memory;
 	}
 	void print_info() {
 		for(int i = 0; i < d; ++i) {
 			for (int j = 0; j < w; ++j) {
-				std::cout << counter[i][j] << " ";
+				std::cout << counter[i].get(j) << " ";
 			}
 			std::cout << "\n";
 		}
 	}
 private:
+	void update(const uint32_t* index, int32_t value) {
+		// rows are read once; only counters below the new minimum are written
+		int32_t current[MAX_DEPTH];
+		int32_t min_value = 1e9;
+		for (int i = 0; i < d; ++i) {
+			current[i] = counter[i].get(index[i]);
+			min_value = MIN(min_value, current[i]);
+		}
+		int32_t target = min_value + value;
+		for (int i = 0; i < d; ++i) {
+			if (current[i] < target) {
+				counter[i].set(index[i], target);
+			}
+		}
+	}
+
+	typedef typename CounterPolicy<DATA_TYPE>::type COUNTER;
 	int d, w;
-	DATA_TYPE** counter;
+	COUNTER* counter;
+	std::vector<int32_t> batch_slot;
+	std::vector<ID_TYPE> batch_key;
+	std::vector<int32_t> batch_value;
+	std::vector<uint32_t> batch_hash;
 };
 
 template<typename ID_TYPE, typename DATA_TYPE>
 class CountSketch : public Sketch<ID_TYPE> {
 public:
 	CountSketch(int memory, int _d): d(_d) {
-		w = memory * 1024 / sizeof(DATA_TYPE) / d;
-		counter = new DATA_TYPE* [d];
+		assert(d <= MAX_DEPTH);
+		w = COUNTER::width(memory, d);
+		counter = new COUNTER [d];
 		for (int i = 0; i < d; ++i) {
-			counter[i] = new DATA_TYPE [w];
-			memset(counter[i], 0, w * sizeof(DATA_TYPE));
+			counter[i].init(w);
 		}
 	}
 
 	~CountSketch() {
-		for (int i = 0; i < d; ++i) {
-			delete[] counter[i];
-		}
 		delete[] counter;
 	}
 
@@ -170,34 +301,81 @@ public:
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
 			uint32_t sign_index = ::hash(key, 99 + i) % 2;
-			counter[i][index] += count_sketch_sign[sign_index] * value;
+			counter[i].add(index, count_sketch_sign[sign_index] * value);
 		}
 	}
 
 	int32_t query(ID_TYPE key) {
-		std::vector<int32_t> vec;
+		int32_t vec[MAX_DEPTH];
 		for (int i = 0; i < d; ++i) {
 			uint32_t index = ::hash(key, 33 + i) % w;
 			uint32_t sign_index = ::hash(key, 99 + i) % 2;
-			vec.push_back(count_sketch_sign[sign_index] * counter[i][index]);
+			vec[i] = count_sketch_sign[sign_index] * counter[i].get(index);
 		}
-		std::sort(vec.begin(), vec.end());
+		std::sort(vec, vec + d);
 		return vec[(d - 1) / 2];
 	}
+
+	// see CMSketch::widen and CMSketch::narrow
+	void widen() {
+		widen_rows(counter, d, w);
+	}
+
+	void narrow() {
+		fold_rows(counter, d, w);
+	}
+
+	bool narrowable() const {
+		return w % 2 == 0 && w >= 2;
+	}
+
+	void save(std::ostream& out) const {
+		write_value(out, d);
+		write_value(out, w);
+		for (int i = 0; i < d; ++i) {
+			write_counters(out, counter[i], w);
+		}
+	}
+
+	// replaces the rows with the ones from save() of a sketch of at most memory KB
+	bool load(std::istream& in, int memory) {
+		int new_d, new_w;
+		if (!read_value(in, new_d) || !read_value(in, new_w) || new_d <= 0 || new_d > MAX_DEPTH || new_w < 0
+			|| new_d * COUNTER::row_bytes(new_w) > (uint64_t)memory * 1024) {
+			return false;
+		}
+		delete[] counter;
+		d = new_d;
+		w = new_w;
+		counter = new COUNTER [d];
+		for (int i = 0; i < d; ++i) {
+			counter[i].init(w);
+			if (!read_counters(in, counter[i], w)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 	double calculate_memory() {
-		return d * w * sizeof(DATA_TYPE) / 1024.0;
+		double memory = 0;
+		for (int i = 0; i < d; ++i) {
+			memory += counter[i].calculate_memory();
+		}
+		return memory;
 	}
 	void print_info() {
 		for(int i = 0; i < d; ++i) {
 			for (int j = 0; j < w; ++j) {
-				std::cout << counter[i][j] << " ";
+				std::cout << counter[i].get(j) << " ";
 			}
 			std::cout << "\n";
 		}
 	}
 private:
+	typedef typename CounterPolicy<DATA_TYPE>::type COUNTER;
 	int d, w;
-	DATA_TYPE** counter;
+	COUNTER* counter;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <streambuf>
+#include <vector>
+
+// Binary snapshot helpers. Fields are raw host-order bytes, so a snapshot is
+// read back by a build with the same key and counter types.
+
+#define SNAPSHOT_MAGIC 0x4b535657   // "WVSK"
+#define SNAPSHOT_VERSION 3
+
+template<typename T>
+void write_value(std::ostream& out, const T& value) {
+	out.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+bool read_value(std::istream& in, T& value) {
+	return (bool)in.read((char*)&value, sizeof(T));
+}
+
+template<typename T>
+void write_array(std::ostream& out, const T* data, size_t n) {
+	out.write((const char*)data, n * sizeof(T));
+}
+
+template<typename T>
+bool read_array(std::istream& in, T* data, size_t n) {
+	return (bool)in.read((char*)data, n * sizeof(T));
+}
+
+// one row of a counter policy, an int32 per counter whatever its width
+template<typename COUNTER>
+void write_counters(std::ostream& out, const COUNTER& counter, uint32_t w) {
+	int32_t chunk[256];
+	for (uint32_t begin = 0; begin < w; begin += 256) {
+		uint32_t n = w - begin < 256 ? w - begin : 256;
+		counter.load(begin, n, chunk);
+		write_array(out, chunk, n);
+	}
+}
+
+template<typename COUNTER>
+bool read_counters(std::istream& in, COUNTER& counter, uint32_t w) {
+	int32_t chunk[256];
+	for (uint32_t begin = 0; begin < w; begin += 256) {
+		uint32_t n = w - begin < 256 ? w - begin : 256;
+		if (!read_array(in, chunk, n)) {
+			return false;
+		}
+		for (uint32_t k = 0; k < n; ++k) {
+			counter.set(begin + k, chunk[k]);
+		}
+	}
+	return true;
+}
+
+// Stream buffers over memory, for snapshots taken into or read from a buffer
+// instead of a file.
+class SnapshotWriter: public std::streambuf {
+public:
+	SnapshotWriter(std::vector<char>& _buffer): buffer(_buffer) {}
+
+protected:
+	std::streamsize xsputn(const char* data, std::streamsize n) override {
+		buffer.insert(buffer.end(), data, data + n);
+		return n;
+	}
+
+	int overflow(int c) override {
+		if (c != traits_type::eof()) {
+			buffer.push_back((char)c);
+		}
+		return c;
+	}
+
+private:
+	std::vector<char>& buffer;
+};
+
+class SnapshotReader: public std::streambuf {
+public:
+	SnapshotReader(const char* data, size_t n) {
+		setg((char*)data, (char*)data, (char*)data + n);
+	}
+};
+
+#endif
@@ -17,7 +17,7 @@
 template<typename ID_TYPE>
 class CocoSketch : public Sketch<ID_TYPE> {
 public:
-    CocoSketch(int memory, int depth): d(depth) {
+    CocoSketch(int memory, int depth, uint64_t seed = 1): d(depth), random(seed) {
         w = memory * 1024 / (sizeof(uint32_t) + sizeof(ID_TYPE)) / d;
         key_array = new ID_TYPE* [d];
         value_array = new uint32_t* [d];
@@ -44,10 +44,9 @@ public:
                 min_value = value_array[i][index];
             }
         }
-        double r = static_cast<double>(std::rand()) / RAND_MAX;
-        double prob_keep_old = static_cast<double>(min_value) / (min_value + value);
+        // take over the bucket with probability value / (min_value + value)
         value_array[min_array][min_bucket] += value;
-        if (r >= prob_keep_old) {
+        if (random.bernoulli(value, (uint64_t)min_value + value)) {
             key_array[min_array][min_bucket] = key;
         }
     }
@@ -66,6 +65,7 @@ private:
     int d, w;
     ID_TYPE** key_array;
     uint32_t** value_array;
+    RandomPool random;
 };
 
 template<typename ID_TYPE>
@@ -126,7 +126,7 @@ private:
 template<typename ID_TYPE>
 class UnbiasedSpaceSaving : public Sketch<ID_TYPE> {
 public:
-    UnbiasedSpaceSaving(int memory) {
+    UnbiasedSpaceSaving(int memory, uint64_t seed = 1): random(seed) {
         max_size = memory * 1024.0 / (2 * sizeof(ID_TYPE) + 2 * sizeof(int32_t) + 5 * sizeof(void*));
         hash_map.clear();
         sorted_set.clear();
@@ -147,12 +147,10 @@ public:
             auto min_it = *sorted_set.begin();
             ID_TYPE min_key = min_it.second;
             int32_t min_value = min_it.first;
-            double r = static_cast<double>(std::rand()) / RAND_MAX;
-            double prob_keep_old = static_cast<double>(min_value) / (min_value + value);
             auto it = hash_map.find(min_key);
             sorted_set.erase({min_value, min_key});
             hash_map.erase(it);
-            if (r >= prob_keep_old) {
+            if (random.bernoulli(value, (uint64_t)min_value + value)) {
                 hash_map[key] = min_value + value;
                 sorted_set.insert({min_value + value, key});
             }
@@ -174,6 +172,7 @@ private:
     int max_size;
     std::unordered_map<ID_TYPE, int32_t> hash_map;
     std::multiset<std::pair<int32_t, ID_TYPE>> sorted_set;
+    RandomPool random;
 };
 
 
@@ -0,0 +1,679 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <thread>
+#include <unistd.h>
+
+#include "weavesketch.hpp"
+#include "delta.hpp"
+#include "pcap.hpp"
+#include "load_dataset.hpp"
+
+using namespace std;
+
+// Round-trip and invariant checks. Every test prints its name and "ok", or
+// the failed checks; the exit status is 1 if any check failed.
+//
+//   ./tests                 run everything
+//   ./tests NAME            run the tests whose name contains NAME
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+int failures = 0, test_failures = 0;
+
+void check(bool ok, const char* what, const char* file, int line) {
+	if (!ok) {
+		test_failures++;
+		cout << "\n  " << file << ":" << line << ": " << what;
+	}
+}
+
+// keys with about Zipf(1.0) counts over universe flows
+vector<uint64_t> make_keys(int n, uint64_t universe, uint64_t seed) {
+	WyRand random(seed);
+	vector<uint64_t> keys(n);
+	for (int i = 0; i < n; ++i) {
+		double u = (random.next() >> 11) * (1.0 / (1ULL << 53));
+		keys[i] = mix_word((uint64_t)pow((double)universe, u));
+	}
+	return keys;
+}
+
+map<uint64_t, int> count_keys(const vector<uint64_t>& keys) {
+	map<uint64_t, int> truth;
+	for (uint64_t key : keys) {
+		truth[key]++;
+	}
+	return truth;
+}
+
+template<typename SKETCH>
+vector<char> image(SKETCH& sketch) {
+	vector<char> out;
+	DeltaEncoder::image(sketch, out);
+	return out;
+}
+
+template<typename SKETCH>
+bool load_image(SKETCH& sketch, const vector<char>& data) {
+	SnapshotReader reader(data.data(), data.size());
+	std::istream stream(&reader);
+	return sketch.load(stream);
+}
+
+
+void test_overflow_table() {
+	OverflowTable table;
+	map<uint32_t, int32_t> reference;
+	WyRand random(1);
+	for (int i = 0; i < 200000; ++i) {
+		uint32_t index = random.next() % 4096;
+		if (random.next() % 3) {
+			int32_t value = (int32_t)random.next();
+			table[index] = value;
+			reference[index] = value;
+		}
+		else {
+			table.erase(index);
+			reference.erase(index);
+		}
+	}
+	CHECK(table.size() == reference.size());
+	for (auto& p : reference) {
+		CHECK(table.find(p.first) == p.second);
+	}
+	// at most half full, eight bytes a slot
+	CHECK(table.bytes() >= 2 * table.size() * sizeof(uint64_t));
+}
+
+void test_packed_counter() {
+	const uint32_t w = 1000;
+	PackedCounter<4> counter;
+	counter.init(w);
+	vector<int32_t> reference(w, 0);
+	WyRand random(2);
+	for (int i = 0; i < 100000; ++i) {
+		uint32_t index = random.next() % w;
+		int32_t value = (int32_t)(random.next() % 41) - 20;
+		if (random.next() % 4) {
+			counter.add(index, value);
+			reference[index] += value;
+		}
+		else {
+			counter.set(index, value);
+			reference[index] = value;
+		}
+	}
+	vector<int32_t> loaded(w);
+	counter.load(0, w, loaded.data());
+	size_t escaped = 0;
+	for (uint32_t j = 0; j < w; ++j) {
+		CHECK(counter.get(j) == reference[j]);
+		CHECK(loaded[j] == reference[j]);
+		escaped += reference[j] < PackedCounter<4>::MIN_VALUE || reference[j] > PackedCounter<4>::MAX_VALUE;
+	}
+	CHECK(counter.overflow_size() == escaped);
+}
+
+// a CM and a Count sketch folded in half answer like ones built at half the
+// width (6 and 3 KB give exactly half the counters for both policies)
+template<typename DATA_TYPE>
+void fold_rows_case() {
+	vector<uint64_t> keys = make_keys(20000, 5000, 3);
+	CMSketch<uint64_t, DATA_TYPE> cm(6, 3), half_cm(3, 3);
+	CountSketch<uint64_t, DATA_TYPE> cs(6, 3), half_cs(3, 3);
+	for (uint64_t key : keys) {
+		cm.insert(key, 1);
+		cs.insert(key, 1);
+		half_cm.insert(key, 1);
+		half_cs.insert(key, 1);
+	}
+	CHECK(cm.narrowable() && cs.narrowable());
+	cm.narrow();
+	cs.narrow();
+	for (uint64_t key : keys) {
+		CHECK(cm.query(key) == half_cm.query(key));
+		CHECK(cs.query(key) == half_cs.query(key));
+	}
+	half_cm.widen();
+	half_cs.widen();
+	for (uint64_t key : keys) {
+		CHECK(cm.query(key) == half_cm.query(key));
+		CHECK(cs.query(key) == half_cs.query(key));
+	}
+}
+
+void test_fold_rows() {
+	fold_rows_case<int32_t>();
+	fold_rows_case<PackedCounter<4>>();
+}
+
+void test_snapshot_round_trip() {
+	vector<uint64_t> keys = make_keys(300000, 100000, 4);
+	WeaveSketch<uint64_t> sketch(200, 3, 3, 100, 0.8);
+	for (uint64_t key : keys) {
+		sketch.insert(key, 1);
+	}
+	vector<char> saved = image(sketch);
+	WeaveSketch<uint64_t> loaded;
+	CHECK(load_image(loaded, saved));
+	CHECK(image(loaded) == saved);
+	CHECK(loaded.total() == sketch.total());
+	for (auto& p : count_keys(keys)) {
+		QueryInterval a = sketch.query_interval(p.first), b = loaded.query_interval(p.first);
+		CHECK(sketch.query(p.first) == loaded.query(p.first));
+		CHECK(a.lower == b.lower && a.estimate == b.estimate && a.upper == b.upper);
+	}
+	// every truncation is refused, on a loaded sketch and on a fresh one
+	for (size_t n = 0; n < saved.size(); n += 1 + n / 4) {
+		vector<char> prefix(saved.begin(), saved.begin() + n);
+		WeaveSketch<uint64_t> fresh;
+		CHECK(!load_image(fresh, prefix));
+		CHECK(!load_image(loaded, prefix));
+	}
+}
+
+// adaptive sketches reshape both parts, and every shape must load again
+template<typename DATA_TYPE>
+void snapshot_shape_case(const vector<uint64_t>& keys, int memory) {
+	WeaveSketch<uint64_t, DATA_TYPE> sketch(memory, 3, 3, 1000, 0.5), loaded;
+	sketch.enable_adaptive(1 << 12);
+	sketch.enable_relocation(2);
+	for (uint64_t key : keys) {
+		sketch.insert(key, 1);
+	}
+	vector<char> saved = image(sketch);
+	CHECK(load_image(loaded, saved));
+	CHECK(image(loaded) == saved);
+}
+
+// Sizes in the snapshot are checked before anything is allocated for them.
+// The header is magic, version, key size, 14 int32 fields and total_count;
+// the heavy part follows with its array count and size.
+void test_snapshot_sizes() {
+	vector<uint64_t> keys = make_keys(300000, 100000, 10);
+	for (int memory : {50, 130, 400}) {
+		snapshot_shape_case<int8_t>(keys, memory);
+		snapshot_shape_case<int32_t>(keys, memory);
+		snapshot_shape_case<PackedCounter<4>>(keys, memory);
+	}
+	WeaveSketch<uint64_t> sketch(200, 3, 3, 100, 0.8);
+	for (uint64_t key : keys) {
+		sketch.insert(key, 1);
+	}
+	vector<char> saved = image(sketch);
+	const size_t stage1_size = 12 + 7 * 4, memory_budget = 12 + 9 * 4, array_size = 12 + 14 * 4 + 8 + 4;
+	for (auto patch : {make_pair(array_size, 0xffffffffu), make_pair(array_size, 0x10000000u),
+			make_pair(memory_budget, 0x7fffffffu), make_pair(stage1_size, 200u), make_pair(stage1_size, 0xffffffffu)}) {
+		vector<char> corrupt = saved;
+		memcpy(corrupt.data() + patch.first, &patch.second, 4);
+		WeaveSketch<uint64_t> fresh;
+		CHECK(!load_image(fresh, corrupt));
+	}
+}
+
+void test_delta_round_trip() {
+	vector<uint64_t> keys = make_keys(300000, 100000, 5);
+	WeaveSketch<uint64_t> sketch(200, 3, 3, 100, 0.8), replica;
+	DeltaEncoder encoder;
+	DeltaDecoder decoder;
+	vector<uint8_t> frame;
+	for (size_t begin = 0; begin < keys.size(); begin += keys.size() / 6) {
+		for (size_t k = begin; k < keys.size() && k < begin + keys.size() / 6; ++k) {
+			sketch.insert(keys[k], 1);
+		}
+		encoder.encode(sketch, frame);
+		CHECK(decoder.apply(frame.data(), frame.size(), replica));
+		CHECK(image(replica) == image(sketch));
+	}
+	for (auto& p : count_keys(keys)) {
+		CHECK(replica.query(p.first) == sketch.query(p.first));
+	}
+	// a delta without its base is refused
+	sketch.insert(keys[0], 1);
+	encoder.encode(sketch, frame);
+	CHECK(frame[0] == DELTA_CHANGES);
+	DeltaDecoder late;
+	WeaveSketch<uint64_t> other;
+	CHECK(!late.apply(frame.data(), frame.size(), other));
+}
+
+// a full frame's word count is bounded before the image is allocated
+void test_delta_bounds() {
+	uint8_t frame[8] = {DELTA_FULL};
+	uint8_t* end = put_varint(frame + 1, 0xFFFFFFFF);
+	DeltaDecoder decoder;
+	CHECK(!decoder.apply_image(frame, end - frame));
+	CHECK(decoder.image.empty());
+	DeltaDecoder small(1024);
+	end = put_varint(frame + 1, 257);
+	CHECK(!small.apply_image(frame, end - frame));
+	end = put_varint(frame + 1, 256);
+	CHECK(small.apply_image(frame, end - frame));
+	CHECK(small.image.size() == 1024);
+}
+
+void test_spsc_ring() {
+	const uint64_t n = 1000000;
+	SPSCRing<uint64_t> ring(64);
+	thread producer([&] {
+		for (uint64_t i = 1; i <= n; ++i) {
+			while (!ring.push(i)) {
+				this_thread::yield();
+			}
+		}
+	});
+	uint64_t expected = 1, item;
+	bool ordered = true;
+	while (expected <= n) {
+		if (ring.pop(item)) {
+			ordered = ordered && item == expected;
+			expected++;
+		}
+		else {
+			this_thread::yield();
+		}
+	}
+	producer.join();
+	CHECK(ordered);
+	CHECK(ring.empty() && !ring.pop(item));
+}
+
+// used() must match a scan of the heavy part after every kind of reshuffle
+template<typename ID_TYPE>
+uint32_t scan_used(const HeavyPart<ID_TYPE>& heavy) {
+	uint32_t used = 0;
+	heavy.for_each([&](const ID_TYPE&, uint32_t, int32_t) { used++; });
+	return used;
+}
+
+void test_heavy_part_used() {
+	vector<uint64_t> keys = make_keys(200000, 50000, 6);
+	HeavyPart<uint64_t> heavy(64);
+	heavy.set_relocation(RELOCATION_MAX_HOPS);
+	for (uint64_t key : keys) {
+		if (heavy.insert(key, 1) >= 0) {
+			heavy.insert_with_replace(key, 1, 0);
+		}
+	}
+	uint64_t relocations = 0;
+	for (int hops = 1; hops <= RELOCATION_MAX_HOPS; ++hops) {
+		relocations += heavy.relocations(hops);
+	}
+	CHECK(relocations > 0);
+	CHECK(heavy.used() == scan_used(heavy));
+	heavy.expansion();
+	CHECK(heavy.used() == scan_used(heavy));
+	for (uint64_t key : keys) {
+		auto result = heavy.query(key);
+		if (get<0>(result)) {
+			continue;
+		}
+		if (heavy.insert(key, 1) >= 0) {
+			heavy.insert_with_replace(key, 1, 0);
+		}
+	}
+	CHECK(heavy.used() == scan_used(heavy));
+	uint64_t before = 0, after = 0, evicted = 0;
+	heavy.for_each([&](const uint64_t&, uint32_t value, int32_t) { before += value; });
+	CHECK(heavy.shrinkable());
+	heavy.shrink([&](const uint64_t&, uint32_t value) { evicted += value; });
+	heavy.for_each([&](const uint64_t& key, uint32_t value, int32_t) {
+		after += value;
+		CHECK(get<0>(heavy.query(key)) && get<1>(heavy.query(key)) == value);
+	});
+	CHECK(before == after + evicted);
+	CHECK(heavy.used() == scan_used(heavy));
+}
+
+void test_weavesketch_used() {
+	vector<uint64_t> keys = make_keys(500000, 200000, 7);
+	WeaveSketch<uint64_t> sketch(400, 3, 3, 100, 0.8);
+	sketch.enable_relocation(3);
+	for (uint64_t key : keys) {
+		sketch.insert(key, 1);
+	}
+	WeaveSketchStats stats = sketch.stats();
+	uint32_t used = 0;
+	sketch.for_each_heavy([&](const uint64_t&, int32_t) { used++; });
+	CHECK(stats.heavy_expansions > 0);
+	CHECK(stats.heavy_used == used);
+}
+
+// lower <= true count <= upper for every key, upper INT32_MAX meaning none
+template<typename DATA_TYPE>
+void interval_case(const vector<uint64_t>& keys, const map<uint64_t, int>& truth, int memory, int max_error, bool adaptive, bool pipelined = false) {
+	WeaveSketch<uint64_t, DATA_TYPE> sketch(memory, 3, 3, max_error, 0.8);
+	if (adaptive) {
+		sketch.enable_adaptive(1 << 14);
+	}
+	if (pipelined) {
+		sketch.enable_pipeline(64);
+	}
+	for (uint64_t key : keys) {
+		sketch.insert(key, 1);
+	}
+	size_t covered = 0;
+	for (auto& p : truth) {
+		QueryInterval q = sketch.query_interval(p.first);
+		covered += q.lower <= p.second && p.second <= q.upper && q.lower <= q.estimate && q.estimate <= q.upper;
+	}
+	CHECK(covered == truth.size());
+}
+
+void test_query_interval() {
+	vector<uint64_t> keys = make_keys(500000, 200000, 8);
+	map<uint64_t, int> truth = count_keys(keys);
+	for (int memory : {100, 400}) {
+		for (int max_error : {14, 1000}) {
+			for (bool adaptive : {false, true}) {
+				interval_case<int8_t>(keys, truth, memory, max_error, adaptive);
+				interval_case<int32_t>(keys, truth, memory, max_error, adaptive);
+				interval_case<PackedCounter<4>>(keys, truth, memory, max_error, adaptive);
+			}
+			interval_case<int8_t>(keys, truth, memory, max_error, false, true);
+		}
+	}
+}
+
+// a backlog that keeps growing drives the level to its cap; no more light
+// expansions than without sampling, and every packet reaches the HLL
+template<typename DATA_TYPE>
+void overload_case(const vector<uint64_t>& keys, size_t distinct, int max_level) {
+	WeaveSketch<uint64_t, DATA_TYPE> plain(100, 3, 3, 14, 0.8), sampled(100, 3, 3, 14, 0.8);
+	sampled.enable_cardinality();
+	sampled.enable_overload(1);
+	uint64_t backlog = 0;
+	for (uint64_t key : keys) {
+		plain.insert(key, 1);
+		sampled.report_backlog(backlog += 2);
+		sampled.insert(key, 1);
+	}
+	WeaveSketchStats stats = sampled.stats();
+	CHECK(stats.max_sampling_level == max_level);
+	CHECK(stats.light_expansions <= plain.stats().light_expansions);
+	CHECK(fabs(sampled.cardinality() - distinct) < 0.1 * distinct);
+	// a large value kept at the top level saturates instead of wrapping
+	uint64_t dropped;
+	do {
+		dropped = sampled.stats().sampled_out;
+		sampled.report_backlog(backlog += 2);
+		sampled.insert(1ULL << 40, INT32_MAX / 4);
+	} while (sampled.stats().sampled_out != dropped);
+	CHECK(sampled.query(1ULL << 40) > 0);
+}
+
+void test_overload() {
+	vector<uint64_t> keys = make_keys(500000, 200000, 9);
+	size_t distinct = count_keys(keys).size();
+	overload_case<int8_t>(keys, distinct, 4);
+	overload_case<int32_t>(keys, distinct, OVERLOAD_MAX_LEVEL);
+}
+
+
+// Ethernet, IPv4 and TCP headers of a packet from flow (src, dst)
+vector<uint8_t> make_frame(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport) {
+	vector<uint8_t> frame(54, 0);
+	frame[12] = 0x08;
+	uint8_t* ip = frame.data() + 14;
+	ip[0] = 0x45;
+	ip[9] = 6;
+	for (int i = 0; i < 4; ++i) {
+		ip[12 + i] = src >> (24 - 8 * i);
+		ip[16 + i] = dst >> (24 - 8 * i);
+	}
+	uint8_t* tcp = ip + 20;
+	tcp[0] = sport >> 8;
+	tcp[1] = sport;
+	tcp[2] = dport >> 8;
+	tcp[3] = dport;
+	return frame;
+}
+
+void put32(vector<uint8_t>& out, uint32_t value) {
+	out.insert(out.end(), (uint8_t*)&value, (uint8_t*)&value + 4);
+}
+
+void put16(vector<uint8_t>& out, uint16_t value) {
+	out.insert(out.end(), (uint8_t*)&value, (uint8_t*)&value + 2);
+}
+
+// enhanced packet block with the given caplen field, padded to 4 bytes
+void put_epb(vector<uint8_t>& out, const vector<uint8_t>& frame, uint32_t caplen, uint64_t ticks) {
+	uint32_t padded = (frame.size() + 3) / 4 * 4;
+	put32(out, 6);
+	put32(out, 32 + padded);
+	put32(out, 0);
+	put32(out, ticks >> 32);
+	put32(out, (uint32_t)ticks);
+	put32(out, caplen);
+	put32(out, frame.size());
+	out.insert(out.end(), frame.begin(), frame.end());
+	out.resize(out.size() + padded - frame.size(), 0);
+	put32(out, 32 + padded);
+}
+
+vector<uint8_t> pcapng_header() {
+	vector<uint8_t> out;
+	put32(out, 0x0a0d0d0a);
+	put32(out, 28);
+	put32(out, 0x1a2b3c4d);
+	put16(out, 1);
+	put16(out, 0);
+	put32(out, 0xffffffff);
+	put32(out, 0xffffffff);
+	put32(out, 28);
+	put32(out, 1);
+	put32(out, 20);
+	put16(out, LINKTYPE_ETHERNET);
+	put16(out, 0);
+	put32(out, 65535);
+	put32(out, 20);
+	return out;
+}
+
+// keys and timestamps PcapReader gets from a capture with these bytes
+vector<pair<FiveTuple, uint64_t>> read_capture(const vector<uint8_t>& bytes) {
+	char path[] = "/tmp/weavesketch_testXXXXXX";
+	int fd = mkstemp(path);
+	vector<pair<FiveTuple, uint64_t>> packets;
+	if (fd < 0 || write(fd, bytes.data(), bytes.size()) != (ssize_t)bytes.size()) {
+		CHECK(!"temporary capture file");
+		return packets;
+	}
+	close(fd);
+	{
+		PcapReader reader(path);
+		FiveTuple keys[16];
+		uint64_t ts[16];
+		for (int n; reader.ok() && (n = reader.next_batch(keys, ts, 16)) > 0;) {
+			for (int k = 0; k < n; ++k) {
+				packets.push_back(make_pair(keys[k], ts[k]));
+			}
+		}
+	}
+	unlink(path);
+	return packets;
+}
+
+// false if a packet PcapReader hands out reaches past the end of the capture
+bool packets_in_bounds(const vector<uint8_t>& bytes) {
+	char path[] = "/tmp/weavesketch_testXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || write(fd, bytes.data(), bytes.size()) != (ssize_t)bytes.size()) {
+		CHECK(!"temporary capture file");
+		return false;
+	}
+	close(fd);
+	bool ok = true;
+	{
+		PcapReader reader(path);
+		PcapReader::Packet packet;
+		// data is somewhere in the mapping, so it may end at most size bytes past its start
+		while (reader.ok() && reader.next(packet)) {
+			ok = ok && packet.caplen <= bytes.size();
+		}
+	}
+	unlink(path);
+	return ok;
+}
+
+FiveTuple flow_key(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport) {
+	FlowFields fields;
+	vector<uint8_t> frame = make_frame(src, dst, sport, dport);
+	FiveTuple key;
+	parse_flow(frame.data(), frame.size(), LINKTYPE_ETHERNET, fields);
+	PacketKey<FiveTuple>::make(fields, key);
+	return key;
+}
+
+void test_pcap() {
+	vector<uint8_t> pcap;
+	put32(pcap, 0xa1b2c3d4);
+	put16(pcap, 2);
+	put16(pcap, 4);
+	put32(pcap, 0);
+	put32(pcap, 0);
+	put32(pcap, 65535);
+	put32(pcap, LINKTYPE_ETHERNET);
+	for (uint32_t i = 0; i < 100; ++i) {
+		vector<uint8_t> frame = make_frame(0x0a000000 + i % 7, 0x0a000001, 1000 + i % 7, 80);
+		put32(pcap, 10 + i);
+		put32(pcap, 5);
+		put32(pcap, frame.size());
+		put32(pcap, frame.size());
+		pcap.insert(pcap.end(), frame.begin(), frame.end());
+	}
+	vector<pair<FiveTuple, uint64_t>> packets = read_capture(pcap);
+	CHECK(packets.size() == 100);
+	for (uint32_t i = 0; i < packets.size(); ++i) {
+		CHECK(packets[i].first == flow_key(0x0a000000 + i % 7, 0x0a000001, 1000 + i % 7, 80));
+		CHECK(packets[i].second == (10 + i) * 1000000000ULL + 5000);
+	}
+	// a record cut short ends the capture
+	pcap.resize(pcap.size() - 10);
+	CHECK(read_capture(pcap).size() == 99);
+}
+
+void test_pcapng() {
+	vector<uint8_t> pcapng = pcapng_header();
+	for (uint32_t i = 0; i < 100; ++i) {
+		put_epb(pcapng, make_frame(0x0a000000 + i % 5, 0x0a000002, 2000, 443), 54, 1000000 + i);
+	}
+	vector<pair<FiveTuple, uint64_t>> packets = read_capture(pcapng);
+	CHECK(packets.size() == 100);
+	for (uint32_t i = 0; i < packets.size(); ++i) {
+		CHECK(packets[i].first == flow_key(0x0a000000 + i % 5, 0x0a000002, 2000, 443));
+		CHECK(packets[i].second == (1000000 + i) * 1000ULL);
+	}
+}
+
+// Malformed enhanced packet blocks: a caplen that wraps 28 + caplen, one that
+// runs into the trailing length, and blocks cut short are skipped or end the
+// capture. Random byte flips of a valid capture never yield a packet past its end.
+void test_pcapng_malformed() {
+	vector<uint8_t> frame = make_frame(0x0a000001, 0x0a000002, 1, 2);
+	for (uint32_t caplen : {0xffffffffu, 0xfffffff0u, 0xffffffe8u, 57u}) {
+		vector<uint8_t> pcapng = pcapng_header();
+		put_epb(pcapng, frame, caplen, 1);
+		put_epb(pcapng, frame, 54, 2);
+		CHECK(packets_in_bounds(pcapng));
+		CHECK(read_capture(pcapng).size() == 1);
+	}
+	vector<uint8_t> pcapng = pcapng_header();
+	put_epb(pcapng, frame, 54, 1);
+	put_epb(pcapng, frame, 54, 2);
+	for (size_t n = 0; n < pcapng.size(); ++n) {
+		vector<uint8_t> prefix(pcapng.begin(), pcapng.begin() + n);
+		CHECK(packets_in_bounds(prefix));
+	}
+	WyRand random(9);
+	for (int i = 0; i < 2000; ++i) {
+		vector<uint8_t> mutated = pcapng;
+		for (int flips = 1 + random.next() % 4; flips > 0; --flips) {
+			mutated[random.next() % mutated.size()] ^= 1 << (random.next() % 8);
+		}
+		CHECK(packets_in_bounds(mutated));
+	}
+}
+
+// 21-byte CAIDA records come back with per-file inter-arrival times, and a
+// file whose reads fail (a directory opens fine, then pread fails) is an
+// error rather than an empty trace.
+// n records of 10 flows, 100 apart; 21 * n is not a multiple of the block size
+void trace_file_case(uint64_t n) {
+	char path[] = "/tmp/weavesketch_testXXXXXX";
+	int fd = mkstemp(path);
+	vector<uint8_t> bytes;
+	for (uint64_t i = 0; i < n; ++i) {
+		uint64_t key = i % 10, time = 100 * i;
+		size_t at = bytes.size();
+		bytes.resize(at + 21, 0);
+		memcpy(bytes.data() + at, &key, 8);
+		memcpy(bytes.data() + at + 13, &time, 8);
+	}
+	CHECK(fd >= 0 && write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size());
+	close(fd);
+	TraceFile file;
+	CHECK(readTraceFile(path, file));
+	CHECK(file.records.size() == n && file.known == n - 10);
+	for (size_t i = 10; i < file.records.size(); ++i) {
+		CHECK(!file.records[i].first && file.records[i].value == 1000);
+	}
+	unlink(path);
+}
+
+void test_trace_file() {
+	trace_file_case(1000);
+	// two reads, a record straddling them and a short unaligned last one
+	trace_file_case(TRACE_READ_SIZE / 21 + 1001);
+	TraceFile directory;
+	CHECK(!readTraceFile("/tmp", directory));
+}
+
+
+struct Test {
+	const char* name;
+	void (*run)();
+};
+
+const Test tests[] = {
+	{"overflow_table", test_overflow_table},
+	{"packed_counter", test_packed_counter},
+	{"fold_rows", test_fold_rows},
+	{"snapshot_round_trip", test_snapshot_round_trip},
+	{"snapshot_sizes", test_snapshot_sizes},
+	{"delta_round_trip", test_delta_round_trip},
+	{"delta_bounds", test_delta_bounds},
+	{"spsc_ring", test_spsc_ring},
+	{"heavy_part_used", test_heavy_part_used},
+	{"weavesketch_used", test_weavesketch_used},
+	{"query_interval", test_query_interval},
+	{"overload", test_overload},
+	{"pcap", test_pcap},
+	{"pcapng", test_pcapng},
+	{"pcapng_malformed", test_pcapng_malformed},
+	{"trace_file", test_trace_file},
+};
+
+int main(int argc, char** argv) {
+	string filter = argc > 1 ? argv[1] : "";
+	for (const Test& test : tests) {
+		if (string(test.name).find(filter) == string::npos) {
+			continue;
+		}
+		cout << test.name << " " << flush;
+		test_failures = 0;
+		test.run();
+		if (test_failures) {
+			failures++;
+			cout << "\n" << test.name << " FAILED\n";
+		}
+		else {
+			cout << "ok\n";
+		}
+	}
+	return failures ? 1 : 0;
+}
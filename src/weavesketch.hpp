@@ -3,29 +3,114 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <random>
 #include <stdexcept>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "hash.hpp"
+#include "hyperloglog.hpp"
+#include "invertible.hpp"
 #include "sketch.hpp"
+#include "memory.hpp"
+#include "ring.hpp"
 
 
 using namespace std;
 
 #define BUCKET_SIZE 4
+#define HEAVY_ARRAY_NUM 2
+// longest cuckoo path HeavyPart::set_relocation() accepts
+#define RELOCATION_MAX_HOPS 3
+// and the search is skipped once fewer than 1/RELOCATION_MIN_EMPTY of the cells are empty
+#define RELOCATION_MIN_EMPTY 128
+
+// A counter with one writer that any thread may read: the writer does a
+// relaxed load and store, so the insert path pays no locked instruction.
+template<typename T>
+class StatCounter {
+public:
+	StatCounter(T initial = 0): value(initial) {}
+
+	operator T() const {
+		return value.load(std::memory_order_relaxed);
+	}
+
+	StatCounter& operator=(T v) {
+		value.store(v, std::memory_order_relaxed);
+		return *this;
+	}
+
+	StatCounter& operator+=(T v) {
+		return *this = *this + v;
+	}
+
+	StatCounter& operator*=(T v) {
+		return *this = *this * v;
+	}
+
+	T operator++(int) {
+		T old = *this;
+		*this = old + 1;
+		return old;
+	}
+
+private:
+	std::atomic<T> value;
+};
+
+// What a heavy-part cell stores for its key. Narrow keys are kept inline;
+// wide keys (KeyTraits::out_of_line) leave a 32-bit tag in the bucket and the
+// full key in a parallel array that is only read when the tag matches.
+template<typename ID_TYPE, bool OUT_OF_LINE = KeyTraits<ID_TYPE>::out_of_line>
+struct KeySlot {
+	typedef ID_TYPE type;
+	static const size_t BUCKET_ALIGN = alignof(ID_TYPE);
+
+	static type tag(const ID_TYPE& key, uint32_t h) {
+		return key;
+	}
+	static bool empty(const type& slot) {
+		return KeyTraits<ID_TYPE>::is_empty(slot);
+	}
+	static type empty_slot() {
+		return KeyTraits<ID_TYPE>::empty();
+	}
+};
+
+template<typename ID_TYPE>
+struct KeySlot<ID_TYPE, true> {
+	typedef uint32_t type;
+	static const size_t BUCKET_ALIGN = 64;
+
+	static type tag(const ID_TYPE& key, uint32_t h) {
+		return h ? h : 1;
+	}
+	static bool empty(const type& slot) {
+		return !slot;
+	}
+	static type empty_slot() {
+		return 0;
+	}
+};
 
 template <typename ID_TYPE>
-class Bucket {
+class alignas(KeySlot<ID_TYPE>::BUCKET_ALIGN) Bucket {
 public:
+	typedef typename KeySlot<ID_TYPE>::type SLOT_TYPE;
 	Bucket() {
 		memset(key, 0, sizeof(key));
 		memset(value, 0, sizeof(value));
 		memset(error, 0, sizeof(error));
 	}
-	ID_TYPE key[BUCKET_SIZE];
+	SLOT_TYPE key[BUCKET_SIZE];
 	uint32_t value[BUCKET_SIZE];
 	int32_t error[BUCKET_SIZE];
 };
@@ -34,23 +119,42 @@ template <typename ID_TYPE>
 class HeavyPart {
 public:
 	HeavyPart(uint32_t memory) {
-		array_num = 2;
-		array_size = memory * 1024 / sizeof(Bucket<ID_TYPE>) / array_num;
+		array_num = HEAVY_ARRAY_NUM;
+		array_size = memory * 1024 / cell_bytes() / array_num;
 		array = new Bucket<ID_TYPE>* [array_num];
+		key_array = new ID_TYPE* [array_num];
 		for (int i = 0; i < array_num; i++) {
-			array[i] = new Bucket<ID_TYPE> [array_size];
-			memset(array[i], 0, array_size * sizeof(Bucket<ID_TYPE>));
+			array[i] = huge_alloc<Bucket<ID_TYPE>>(array_size);
+			key_array[i] = OUT_OF_LINE ? huge_alloc<ID_TYPE>(array_size * BUCKET_SIZE) : NULL;
+		}
+		cells = array_num * array_size * BUCKET_SIZE;
+	}
+
+	~HeavyPart() {
+		for (int i = 0; i < array_num; ++i) {
+			huge_free(array[i], array_size);
+			huge_free(key_array[i], array_size * BUCKET_SIZE);
 		}
+		delete[] array;
+		delete[] key_array;
 	}
 
 	int insert(ID_TYPE key, int32_t value) {
+		uint32_t h[HEAVY_ARRAY_NUM];
+		locate(key, h);
+		return insert(key, value, h);
+	}
+
+	// insert with the bucket hashes from locate()
+	int insert(ID_TYPE key, int32_t value, const uint32_t* h) {
 		// return -1 if insertion success
 		// else, return the minimum value in all related buckets
 		int min_value = 1e9;
 		for (int i = 0; i < array_num; ++i) {
-			uint32_t index = ::hash(key, i) % array_size;
+			uint32_t index = h[i] % array_size;
+			SLOT_TYPE tag = SLOT::tag(key, h[i]);
 			for (int j = 0; j < BUCKET_SIZE; ++j) {
-				if (array[i][index].key[j] == key) {
+				if (match(i, index, j, key, tag)) {
 					array[i][index].value[j] += value;
 					return -1;
 				}
@@ -59,69 +163,188 @@ public:
 				}
 			}
 		}
+		// a search rarely finds one of the last few empty cells
+		if (min_value > 0 && relocation_hops && (uint64_t)(cells - used_cells) * RELOCATION_MIN_EMPTY >= cells && relocate(h)) {
+			return 0;
+		}
 		return min_value;
 	}
 
+	// Cuckoo relocation before an eviction: when both candidate buckets are
+	// full, insert() searches breadth-first for a path of at most max_hops
+	// resident keys, each moving to its bucket in the other array, that ends
+	// at an empty cell. Shifting the keys along it empties a candidate cell,
+	// which the insert_with_replace() that follows takes instead of evicting
+	// the minimum. 0 (the default) turns it off.
+	void set_relocation(int max_hops) {
+		relocation_hops = max_hops < RELOCATION_MAX_HOPS ? max_hops : RELOCATION_MAX_HOPS;
+	}
+
+	// relocations that moved hops keys, 1 <= hops <= RELOCATION_MAX_HOPS
+	uint64_t relocations(int hops) const {
+		return relocated[hops - 1];
+	}
+
+	// searches that found no path, each followed by an eviction
+	uint64_t relocation_failures() const {
+		return relocation_misses;
+	}
+
 	tuple<ID_TYPE, uint32_t> insert_with_replace(ID_TYPE key, uint32_t value, int32_t error) {
-		uint32_t min_array_index, min_bucket_index, min_cell_index;
-		ID_TYPE min_key;
-		uint32_t min_value = -1;
+		// start from the first cell of the first candidate bucket, so a table
+		// whose cells all hold UINT32_MAX still evicts a valid cell
+		uint32_t min_hash = ::hash(key, 0);
+		uint32_t min_array_index = 0, min_bucket_index = min_hash % array_size, min_cell_index = 0;
+		uint32_t min_value = array[0][min_bucket_index].value[0];
 		for (int i = 0; i < array_num; ++i) {
-			uint32_t index = ::hash(key, i) % array_size;
+			uint32_t h = ::hash(key, i), index = h % array_size;
 			for (int j = 0; j < BUCKET_SIZE; ++j) {
 				if (array[i][index].value[j] < min_value) {
-					min_key = array[i][index].key[j];
 					min_value = array[i][index].value[j];
 					min_array_index = i;
 					min_bucket_index = index;
 					min_cell_index = j;
+					min_hash = h;
 				}
 			}
 		}
-		array[min_array_index][min_bucket_index].key[min_cell_index] = key;
+		ID_TYPE min_key = get_key(min_array_index, min_bucket_index, min_cell_index);
+		if (SLOT::empty(array[min_array_index][min_bucket_index].key[min_cell_index])) {
+			used_cells++;
+		}
+		set_key(min_array_index, min_bucket_index, min_cell_index, key, SLOT::tag(key, min_hash));
 		array[min_array_index][min_bucket_index].value[min_cell_index] = value;
 		array[min_array_index][min_bucket_index].error[min_cell_index] = error;
 		return make_pair(min_key, min_value);
 	}
 
 	tuple<bool, uint32_t, uint32_t> query(ID_TYPE key) {
+		uint32_t h[HEAVY_ARRAY_NUM];
+		locate(key, h);
+		return query(key, h);
+	}
+
+	// bucket hashes of key, one per array, for prefetch() and query(key, h)
+	void locate(const ID_TYPE& key, uint32_t* h) const {
 		for (int i = 0; i < array_num; ++i) {
-			uint32_t index = ::hash(key, i) % array_size;
+			h[i] = ::hash(key, i);
+		}
+	}
+
+	void prefetch(const uint32_t* h) const {
+		for (int i = 0; i < array_num; ++i) {
+			__builtin_prefetch(&array[i][h[i] % array_size]);
+		}
+	}
+
+	tuple<bool, uint32_t, uint32_t> query(const ID_TYPE& key, const uint32_t* h) const {
+		for (int i = 0; i < array_num; ++i) {
+			uint32_t index = h[i] % array_size;
+			SLOT_TYPE tag = SLOT::tag(key, h[i]);
 			for (int j = 0; j < BUCKET_SIZE; ++j) {
-				if (array[i][index].key[j] == key) {
-					return make_tuple(true, array[i][index].value[j], array[i][j].error[j]);
+				if (match(i, index, j, key, tag)) {
+					return make_tuple(true, array[i][index].value[j], array[i][index].error[j]);
 				}
 			}
 		}
 		return make_tuple(false, 0, 0);
 	}
 
-	void expansion() {
-		// std::cout << "heavy expansion\n";
-		Bucket<ID_TYPE> array_old[array_num][array_size];
-		uint32_t array_size_old = array_size;
+	void set_error(ID_TYPE key, int32_t error) {
 		for (int i = 0; i < array_num; ++i) {
-			memcpy(array_old[i], array[i], sizeof(Bucket<ID_TYPE>) * array_size_old);
-			delete[] array[i];
+			uint32_t h = ::hash(key, i), index = h % array_size;
+			SLOT_TYPE tag = SLOT::tag(key, h);
+			for (int j = 0; j < BUCKET_SIZE; ++j) {
+				if (match(i, index, j, key, tag)) {
+					array[i][index].error[j] = error;
+					return;
+				}
+			}
 		}
-		delete[] array;
+	}
+
+	// calls f(key, value, error) for every occupied cell
+	template<typename F>
+	void for_each(F f) const {
+		for (int i = 0; i < array_num; ++i) {
+			for (uint32_t k = 0; k < array_size; ++k) {
+				for (int j = 0; j < BUCKET_SIZE; ++j) {
+					if (!SLOT::empty(array[i][k].key[j])) {
+						f(get_key(i, k, j), array[i][k].value[j], array[i][k].error[j]);
+					}
+				}
+			}
+		}
+	}
+
+	bool aligned(const HeavyPart& other) const {
+		return array_num == other.array_num && array_size == other.array_size;
+	}
 
+	// Walks this and an aligned() heavy part bucket by bucket. Every cell of
+	// this part goes to f(key, this_result, other_result), where other_result
+	// is the same key's cell in the other part's bucket, if any; cells of the
+	// other part without a match in this bucket go to g(key, other_result).
+	template<typename F, typename G>
+	void for_each_aligned(const HeavyPart& other, F f, G g) const {
+		for (int i = 0; i < array_num; ++i) {
+			for (uint32_t k = 0; k < array_size; ++k) {
+				const Bucket<ID_TYPE>& a = array[i][k];
+				const Bucket<ID_TYPE>& b = other.array[i][k];
+				int matched = 0;
+				for (int j = 0; j < BUCKET_SIZE; ++j) {
+					if (SLOT::empty(a.key[j])) {
+						continue;
+					}
+					ID_TYPE key = get_key(i, k, j);
+					tuple<bool, uint32_t, uint32_t> other_result(false, 0, 0);
+					for (int l = 0; l < BUCKET_SIZE; ++l) {
+						if (other.match(i, k, l, key, a.key[j])) {
+							other_result = make_tuple(true, b.value[l], b.error[l]);
+							matched |= 1 << l;
+							break;
+						}
+					}
+					f(key, make_tuple(true, a.value[j], (uint32_t)a.error[j]), other_result);
+				}
+				for (int l = 0; l < BUCKET_SIZE; ++l) {
+					if (!(matched >> l & 1) && !SLOT::empty(b.key[l])) {
+						g(other.get_key(i, k, l), make_tuple(true, b.value[l], (uint32_t)b.error[l]));
+					}
+				}
+			}
+		}
+	}
+
+	void expansion() {
+		// std::cout << "heavy expansion\n";
+		// both halves of the doubled array start as copies of the old one
+		uint32_t array_size_old = array_size;
 		array_size *= 2;
-		array = new Bucket<ID_TYPE>* [array_num];
+		cells *= 2;
 		for (int i = 0; i < array_num; i++) {
-			array[i] = new Bucket<ID_TYPE> [array_size];
-			memcpy(array[i], array_old[i], sizeof(Bucket<ID_TYPE>) * array_size_old);
-			memcpy(array[i] + array_size / 2, array_old[i], sizeof(Bucket<ID_TYPE>) * array_size_old);
+			Bucket<ID_TYPE>* array_new = huge_alloc<Bucket<ID_TYPE>>(array_size);
+			memcpy(array_new, array[i], sizeof(Bucket<ID_TYPE>) * array_size_old);
+			memcpy(array_new + array_size_old, array[i], sizeof(Bucket<ID_TYPE>) * array_size_old);
+			huge_free(array[i], array_size_old);
+			array[i] = array_new;
+			if (OUT_OF_LINE) {
+				ID_TYPE* key_array_new = huge_alloc<ID_TYPE>(array_size * BUCKET_SIZE);
+				memcpy(key_array_new, key_array[i], sizeof(ID_TYPE) * array_size_old * BUCKET_SIZE);
+				memcpy(key_array_new + array_size_old * BUCKET_SIZE, key_array[i], sizeof(ID_TYPE) * array_size_old * BUCKET_SIZE);
+				huge_free(key_array[i], array_size_old * BUCKET_SIZE);
+				key_array[i] = key_array_new;
+			}
 		}
 		for (int i = 0; i < array_num; ++i) {
 			for (int k = 0; k < array_size; ++k) {
 				for (int j = 0; j < BUCKET_SIZE; ++j) {
-					if (!array[i][k].key[j]) {
+					if (SLOT::empty(array[i][k].key[j])) {
 						continue;
 					}
-					int32_t correct_index = ::hash(array[i][k].key[j], i) % array_size;
+					int32_t correct_index = ::hash(get_key(i, k, j), i) % array_size;
 					if (correct_index != k) {
-						array[i][k].key[j] = 0;
+						array[i][k].key[j] = SLOT::empty_slot();
 						array[i][k].value[j] = 0;
 						array[i][k].error[j] = 0;
 					}
@@ -129,23 +352,260 @@ public:
 			}
 		}
 	}
-	double calculate_memory() {
-		int used_cells = 0, num_cells = array_num * array_size * BUCKET_SIZE;
+
+	bool shrinkable() const {
+		return array_size % 2 == 0 && array_size >= 2;
+	}
+
+	// The inverse of expansion(): bucket k + array_size / 2 folds into bucket
+	// k, which keeps the BUCKET_SIZE largest of their keys; evict(key, value)
+	// receives the others.
+	template<typename F>
+	void shrink(F evict) {
+		struct Cell {
+			ID_TYPE key;
+			SLOT_TYPE tag;
+			uint32_t value;
+			int32_t error;
+		};
+		uint32_t half = array_size / 2;
 		for (int i = 0; i < array_num; ++i) {
-			for (int j = 0; j < array_size; ++j) {
-				for (int k = 0; k < BUCKET_SIZE; ++k) {
-					if (array[i][j].key[k]) {
-						used_cells++;
+			for (uint32_t k = 0; k < half; ++k) {
+				Cell cell[2 * BUCKET_SIZE];
+				int n = 0;
+				for (uint32_t index = k; index < array_size; index += half) {
+					for (int j = 0; j < BUCKET_SIZE; ++j) {
+						if (SLOT::empty(array[i][index].key[j])) {
+							continue;
+						}
+						Cell c = {get_key(i, index, j), array[i][index].key[j], array[i][index].value[j], array[i][index].error[j]};
+						int l = n++;
+						for (; l > 0 && cell[l - 1].value < c.value; --l) {
+							cell[l] = cell[l - 1];
+						}
+						cell[l] = c;
 					}
-				}	
+				}
+				Bucket<ID_TYPE>& bucket = array[i][k];
+				for (int j = 0; j < BUCKET_SIZE; ++j) {
+					if (j < n) {
+						set_key(i, k, j, cell[j].key, cell[j].tag);
+						bucket.value[j] = cell[j].value;
+						bucket.error[j] = cell[j].error;
+					}
+					else {
+						bucket.key[j] = SLOT::empty_slot();
+						bucket.value[j] = 0;
+						bucket.error[j] = 0;
+					}
+				}
+				for (int j = BUCKET_SIZE; j < n; ++j) {
+					evict(cell[j].key, cell[j].value);
+				}
+			}
+			Bucket<ID_TYPE>* array_new = huge_alloc<Bucket<ID_TYPE>>(half);
+			memcpy(array_new, array[i], sizeof(Bucket<ID_TYPE>) * half);
+			huge_free(array[i], array_size);
+			array[i] = array_new;
+			if (OUT_OF_LINE) {
+				ID_TYPE* key_array_new = huge_alloc<ID_TYPE>(half * BUCKET_SIZE);
+				memcpy(key_array_new, key_array[i], sizeof(ID_TYPE) * half * BUCKET_SIZE);
+				huge_free(key_array[i], array_size * BUCKET_SIZE);
+				key_array[i] = key_array_new;
+			}
+		}
+		array_size = half;
+		cells = array_num * array_size * BUCKET_SIZE;
+		uint32_t used = 0;
+		for_each([&](const ID_TYPE&, uint32_t, int32_t) { used++; });
+		used_cells = used;
+	}
+
+	void save(std::ostream& out) const {
+		write_value(out, array_num);
+		write_value(out, array_size);
+		for (int i = 0; i < array_num; ++i) {
+			write_array(out, array[i], array_size);
+			if (OUT_OF_LINE) {
+				write_array(out, key_array[i], array_size * BUCKET_SIZE);
+			}
+		}
+	}
+
+	// Replaces the buckets with the ones from save() of a heavy part of at
+	// most memory KB; false for arrays that would not fit in it.
+	bool load(std::istream& in, uint32_t memory) {
+		uint32_t new_array_num, new_array_size;
+		if (!read_value(in, new_array_num) || !read_value(in, new_array_size) || new_array_num != array_num
+			|| (uint64_t)new_array_size * array_num * cell_bytes() > (uint64_t)memory * 1024) {
+			return false;
+		}
+		// cleared first, so a failed allocation leaves nothing to free twice
+		for (int i = 0; i < array_num; ++i) {
+			huge_free(array[i], array_size);
+			huge_free(key_array[i], array_size * BUCKET_SIZE);
+			array[i] = NULL;
+			key_array[i] = NULL;
+		}
+		array_size = new_array_size;
+		bool ok = true;
+		for (int i = 0; i < array_num; ++i) {
+			array[i] = huge_alloc<Bucket<ID_TYPE>>(array_size);
+			key_array[i] = OUT_OF_LINE ? huge_alloc<ID_TYPE>(array_size * BUCKET_SIZE) : NULL;
+			ok = ok && read_array(in, array[i], array_size);
+			if (OUT_OF_LINE) {
+				ok = ok && read_array(in, key_array[i], array_size * BUCKET_SIZE);
+			}
+		}
+		uint32_t used = 0;
+		for (int i = 0; ok && i < array_num; ++i) {
+			for (uint32_t k = 0; k < array_size; ++k) {
+				for (int j = 0; j < BUCKET_SIZE; ++j) {
+					used += !SLOT::empty(array[i][k].key[j]);
+				}
 			}
 		}
-		return 2 * array_size * sizeof(Bucket<ID_TYPE>) / 1024.0;
+		cells = array_num * array_size * BUCKET_SIZE;
+		used_cells = used;
+		return ok;
+	}
+
+	// cells holding a key, kept up to date by insert_with_replace; an
+	// expansion keeps each key once per array
+	uint32_t used() const {
+		return used_cells;
+	}
+
+	uint32_t capacity() const {
+		return cells;
+	}
+
+	double calculate_memory() {
+		return 2 * array_size * cell_bytes() / 1024.0;
 	}
 private:
+	typedef KeySlot<ID_TYPE> SLOT;
+	typedef typename SLOT::type SLOT_TYPE;
+	static const bool OUT_OF_LINE = KeyTraits<ID_TYPE>::out_of_line;
+
+	// bytes per bucket, including its out-of-line keys
+	static size_t cell_bytes() {
+		return sizeof(Bucket<ID_TYPE>) + (OUT_OF_LINE ? BUCKET_SIZE * sizeof(ID_TYPE) : 0);
+	}
+
+	struct RelocationStep {
+		uint32_t index;
+		int16_t array, cell;
+		int parent;     // step whose key moves into this cell, -1 for a candidate cell
+	};
+
+	// candidate cells, then up to BUCKET_SIZE children per step and hop
+	static const int RELOCATION_STEPS = HEAVY_ARRAY_NUM * BUCKET_SIZE * (1 + BUCKET_SIZE + BUCKET_SIZE * BUCKET_SIZE);
+
+	bool relocate(const uint32_t* h) {
+		RelocationStep step[RELOCATION_STEPS];
+		uint32_t value[HEAVY_ARRAY_NUM * BUCKET_SIZE];
+		int n = 0;
+		// coldest candidates first: a moved key may cost its hits a second bucket
+		for (int i = 0; i < array_num; ++i) {
+			uint32_t index = h[i] % array_size;
+			for (int j = 0; j < BUCKET_SIZE; ++j) {
+				int k = n++;
+				for (; k > 0 && value[k - 1] > array[i][index].value[j]; --k) {
+					step[k] = step[k - 1];
+					value[k] = value[k - 1];
+				}
+				step[k] = RelocationStep{index, (int16_t)i, (int16_t)j, -1};
+				value[k] = array[i][index].value[j];
+			}
+		}
+		for (int hops = 1, begin = 0; hops <= relocation_hops; ++hops) {
+			int end = n;
+			for (int s = begin; s < end; ++s) {
+				ID_TYPE key = get_key(step[s].array, step[s].index, step[s].cell);
+				for (int a = 0; a < array_num; ++a) {
+					if (a == step[s].array) {
+						continue;
+					}
+					uint32_t index = ::hash(key, a) % array_size;
+					for (int j = 0; j < BUCKET_SIZE; ++j) {
+						if (SLOT::empty(array[a][index].key[j])) {
+							shift(step, s, a, index, j);
+							relocated[hops - 1]++;
+							return true;
+						}
+					}
+					for (int j = 0; j < BUCKET_SIZE && hops < relocation_hops && n < RELOCATION_STEPS; ++j) {
+						if (!on_path(step, s, a, index, j)) {
+							step[n++] = RelocationStep{index, (int16_t)a, (int16_t)j, s};
+						}
+					}
+				}
+			}
+			begin = end;
+		}
+		relocation_misses++;
+		return false;
+	}
+
+	bool on_path(const RelocationStep* step, int s, int a, uint32_t index, int j) const {
+		for (; s >= 0; s = step[s].parent) {
+			if (step[s].array == a && step[s].index == index && step[s].cell == j) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// moves the keys along the path ending at step s into the empty cell
+	// (a, index, j), last key first, and clears the candidate cell
+	void shift(const RelocationStep* step, int s, int a, uint32_t index, int j) {
+		for (; s >= 0; s = step[s].parent) {
+			Bucket<ID_TYPE>& from = array[step[s].array][step[s].index];
+			ID_TYPE key = get_key(step[s].array, step[s].index, step[s].cell);
+			set_key(a, index, j, key, SLOT::tag(key, ::hash(key, a)));
+			array[a][index].value[j] = from.value[step[s].cell];
+			array[a][index].error[j] = from.error[step[s].cell];
+			a = step[s].array;
+			index = step[s].index;
+			j = step[s].cell;
+		}
+		array[a][index].key[j] = SLOT::empty_slot();
+		array[a][index].value[j] = 0;
+		array[a][index].error[j] = 0;
+	}
+
+	bool match(int i, uint32_t index, int j, const ID_TYPE& key, SLOT_TYPE tag) const {
+		if (!(array[i][index].key[j] == tag)) {
+			return false;
+		}
+		return !OUT_OF_LINE || key_array[i][index * BUCKET_SIZE + j] == key;
+	}
+
+	ID_TYPE get_key(int i, uint32_t index, int j) const {
+		if constexpr (OUT_OF_LINE) {
+			return SLOT::empty(array[i][index].key[j]) ? KeyTraits<ID_TYPE>::empty() : key_array[i][index * BUCKET_SIZE + j];
+		}
+		else {
+			return array[i][index].key[j];
+		}
+	}
+
+	void set_key(int i, uint32_t index, int j, const ID_TYPE& key, SLOT_TYPE tag) {
+		array[i][index].key[j] = tag;
+		if (OUT_OF_LINE) {
+			key_array[i][index * BUCKET_SIZE + j] = key;
+		}
+	}
+
 	Bucket<ID_TYPE>** array;
+	ID_TYPE** key_array;
 	uint32_t array_num;
 	uint32_t array_size;
+	StatCounter<uint32_t> cells, used_cells;
+	int relocation_hops = 0;
+	StatCounter<uint64_t> relocated[RELOCATION_MAX_HOPS];
+	StatCounter<uint64_t> relocation_misses;
 };
 
 template<typename ID_TYPE, typename DATA_TYPE>
@@ -160,9 +620,14 @@ public:
 		delete cm_sketch;
 	}
 
-	void insert(ID_TYPE key, int32_t value) {
-		cm_sketch->insert(key, value);
+	// returns the largest CM counter of key afterwards, before any wrap
+	int64_t insert(ID_TYPE key, int32_t value) {
 		count_sketch->insert(key, value);
+		return cm_sketch->insert_peak(key, value);
+	}
+
+	int32_t counter_limit() const {
+		return CMSketch<ID_TYPE, DATA_TYPE>::counter_limit();
 	}
 
 	uint32_t query_upper_bound(ID_TYPE key) {
@@ -173,13 +638,61 @@ public:
 		return count_sketch->query(key);
 	}
 
-	void expansion() {
+	int32_t query_cm(ID_TYPE key) {
+		return cm_sketch->query(key);
+	}
+
+	// the new stage gets new_memory KB, or twice the old size
+	void expansion(int new_memory = 0) {
 		// std::cout << "light expansion\n";
 		delete cm_sketch;
 		delete count_sketch;
-		memory *= 2;
+		memory = new_memory ? new_memory : memory * 2;
 		count_sketch = new CountSketch<ID_TYPE, DATA_TYPE>(memory / 2, d);
 		cm_sketch = new CMSketch<ID_TYPE, DATA_TYPE>(memory / 2, d);
+		widened = false;
+	}
+
+	// f(value) for every counter of one CM row
+	template<typename F>
+	void for_each_counter(F f) const {
+		cm_sketch->for_each_counter(f);
+	}
+
+	// twice the memory without starting a new stage (see CMSketch::widen)
+	void widen() {
+		count_sketch->widen();
+		cm_sketch->widen();
+		memory *= 2;
+		widened = true;
+	}
+
+	// Half the memory for a stage that was never widened, counts kept exactly;
+	// returns the largest CM counter afterwards, before any wrap. Each sketch
+	// must have an even number of KB, so that the halves still fit memory / 2.
+	bool narrowable() const {
+		return !widened && memory % 4 == 0 && count_sketch->narrowable() && cm_sketch->narrowable();
+	}
+
+	int64_t narrow() {
+		count_sketch->narrow();
+		memory /= 2;
+		return cm_sketch->narrow();
+	}
+
+	void save(std::ostream& out) const {
+		write_value(out, d);
+		write_value(out, memory);
+		cm_sketch->save(out);
+		count_sketch->save(out);
+	}
+
+	// a snapshot does not say whether the stage was widened; false for a
+	// stage of more than max_memory KB
+	bool load(std::istream& in, int max_memory) {
+		widened = true;
+		return read_value(in, d) && read_value(in, memory) && memory >= 0 && memory <= max_memory
+			&& cm_sketch->load(in, memory / 2) && count_sketch->load(in, memory / 2);
 	}
 
 	double calculate_memory() {
@@ -189,13 +702,66 @@ public:
 private:
 	int d;
 	int memory;
+	bool widened = false;
 	CountSketch<ID_TYPE, DATA_TYPE>* count_sketch;
 	CMSketch<ID_TYPE, DATA_TYPE>* cm_sketch;
 };
 
 
 
+struct QueryInterval {
+	int32_t lower, estimate, upper;
+};
+
+// A key whose count moved by at least the threshold between two epochs;
+// change is the difference of the point estimates, and the true change lies
+// within [after.lower - before.upper, after.upper - before.lower].
 template<typename ID_TYPE>
+struct HeavyChange {
+	ID_TYPE key;
+	QueryInterval before, after;
+	int32_t change;
+};
+
+// Runtime state of a WeaveSketch, for metrics scrapers (see stats()).
+struct WeaveSketchStats {
+	uint64_t inserted;             // sum of inserted values
+	uint32_t heavy_cells, heavy_used;
+	uint64_t evictions;            // heavy cells handed to the light part with their key
+	uint64_t light_inserts;
+	uint64_t light_saturated;      // light inserts whose CM bound reached half the current error
+	double heavy_occupancy, light_saturation;
+	int heavy_expansions, light_expansions;
+	int heavy_insertion_failures;  // since the last heavy expansion
+	int current_error, total_error, max_error;
+	int heavy_memory, light_memory;  // KB
+	// overload mode: packets are kept with probability sampling_rate
+	double sampling_rate;
+	int sampling_level, max_sampling_level;  // sampling_rate is 2^-sampling_level
+	uint64_t sampled_out;          // packets dropped by sampling
+	double insert_rate;            // insert() calls per second over the last window
+	// heavy-part relocations by number of keys moved, and searches that ended in an eviction
+	uint64_t relocations[RELOCATION_MAX_HOPS];
+	uint64_t relocation_failures;
+};
+
+#define QUERY_BATCH 16
+// adaptive mode: a part asks for memory when its pressure over an epoch exceeds this
+#define ADAPT_MIN_PRESSURE 0.01
+// and the heavy part only while fewer heavy-path inserts than this hit it
+#define ADAPT_HIT_TARGET 0.95
+// and takes memory from the other part when its pressure is this many times larger
+#define ADAPT_TRANSFER_RATIO 2
+// overload mode: insert() calls per controller window, and the lowest
+// sampling rate, 2^-OVERLOAD_MAX_LEVEL
+#define OVERLOAD_WINDOW 4096
+#define OVERLOAD_MAX_LEVEL 10
+// heavy-cell error of a key admitted in pipelined mode until the light thread answers
+#define HEAVY_ERROR_PENDING INT32_MIN
+
+// DATA_TYPE is the light-part counter: a plain integer type or a counter
+// policy such as PackedCounter<4>.
+template<typename ID_TYPE, typename DATA_TYPE = int8_t>
 class WeaveSketch: public Sketch<ID_TYPE> {
 public:
 	WeaveSketch() {}
@@ -205,63 +771,829 @@ public:
 		int heavy_memory = memory_ratio * memory, light_memory = (1 - memory_ratio) * memory;
         int initial_heavy_memory = heavy_memory / pow(2, max_expansion_time), initial_light_memory = light_memory / pow(2, max_expansion_time);
 		stage1 = new HeavyPart<ID_TYPE>(initial_heavy_memory);
-		stage2 = new LightPart<ID_TYPE, int8_t>(initial_light_memory, d);
+		stage2 = new LightPart<ID_TYPE, DATA_TYPE>(initial_light_memory, d);
+		memory_budget = memory;
+		stage1_size = initial_heavy_memory;
+		stage2_size = initial_light_memory;
+	}
+
+	~WeaveSketch() {
+		if (light_thread.joinable()) {
+			sync();
+			pipeline_stop.store(true, std::memory_order_release);
+			light_thread.join();
+		}
+		delete light_tasks;
+		delete light_results;
+		delete stage1;
+		delete stage2;
+		delete invertible;
+		delete hll;
+		delete overload_random;
+		delete[] cache;
+	}
+
+	// Direct-mapped aggregation cache in front of the heavy part: repeated
+	// keys accumulate here and reach the heavy part only on eviction or flush.
+	void enable_front_cache(uint32_t slots) {
+		cache_size = 1;
+		while (cache_size < slots) {
+			cache_size <<= 1;
+		}
+		delete[] cache;
+		cache = new CacheEntry [cache_size];
+		memset(cache, 0, cache_size * sizeof(CacheEntry));
+	}
+
+	void flush() {
+		for (uint32_t i = 0; i < cache_size; ++i) {
+			if (cache[i].value) {
+				insert_heavy(cache[i].key, cache[i].value);
+				cache[i].value = 0;
+			}
+		}
+	}
+
+	// Pipelined mode: the calling thread runs the heavy part and hands every
+	// eviction to a second thread that owns the light part. The light-part
+	// error of a newly admitted key comes back asynchronously and is written
+	// into its heavy cell once it arrives; until then the cell holds
+	// HEAVY_ERROR_PENDING. Queries sync() first, so they wait for every
+	// result; a key evicted and admitted again gets the result of its last
+	// admission, which is applied after the stale one.
+	void enable_pipeline(uint32_t ring_size = 4096) {
+		if (light_thread.joinable()) {
+			return;
+		}
+		if (adaptive) {
+			throw std::invalid_argument("pipelined mode does not support adaptive memory");
+		}
+		light_tasks = new SPSCRing<LightTask>(ring_size);
+		light_results = new SPSCRing<LightResult>(2 * ring_size);
+		light_thread = std::thread(&WeaveSketch::light_loop, this);
+	}
+
+	// Keeps every eviction in an invertible table as well, so heavy_hitters()
+	// can recover keys that left the heavy part without a key list.
+	void enable_invertible(uint32_t memory) {
+		sync();
+		delete invertible;
+		invertible = new InvertibleLightPart<ID_TYPE>(memory);
+	}
+
+	// f(key, estimate) for every key in the heavy part, without allocating
+	template<typename F>
+	void for_each_heavy(F f) {
+		sync();
+		stage1->for_each([&](const ID_TYPE& key, uint32_t value, int32_t error) {
+			f(key, (int32_t)(value + error) + cached_value(key));
+		});
+	}
+
+	// Keys whose estimated count reaches threshold: the heavy cells, plus the
+	// evicted keys decoded from the invertible table when it is enabled. A
+	// decoded count replaces the light-part error of a key that came back.
+	vector<pair<ID_TYPE, int32_t>> heavy_hitters(int32_t threshold) {
+		sync();
+		unordered_map<ID_TYPE, int32_t> decoded;
+		if (invertible) {
+			for (auto& item: invertible->decode()) {
+				decoded[item.first] = item.second;
+			}
+		}
+		vector<pair<ID_TYPE, int32_t>> result;
+		stage1->for_each([&](const ID_TYPE& key, uint32_t value, int32_t error) {
+			auto it = decoded.find(key);
+			int32_t count = value + cached_value(key);
+			if (it != decoded.end()) {
+				count += it->second;
+				decoded.erase(it);
+			}
+			else {
+				count += error;
+			}
+			if (count >= threshold) {
+				result.push_back(make_pair(key, count));
+			}
+		});
+		for (auto& item: decoded) {
+			int32_t count = item.second + cached_value(item.first);
+			if (count >= threshold) {
+				result.push_back(make_pair(item.first, count));
+			}
+		}
+		return result;
+	}
+
+	// Keys whose estimate moved by at least threshold from this sketch (the
+	// earlier epoch) to after, a sketch of the same configuration. When both
+	// heavy parts went through the same expansions their buckets line up and
+	// are compared in one pass; only keys found in a single aligned bucket are
+	// hashed and looked up in full. Keys decoded from either invertible table
+	// are candidates too.
+	vector<HeavyChange<ID_TYPE>> heavy_changes(WeaveSketch& after, int32_t threshold) {
+		sync();
+		after.sync();
+		vector<HeavyChange<ID_TYPE>> result;
+		auto report = [&](const ID_TYPE& key, const tuple<bool, uint32_t, uint32_t>& before_result, const tuple<bool, uint32_t, uint32_t>& after_result) {
+			// heavy hits need no light-part lookups until the key qualifies
+			int32_t change = after.query_heavy(key, after_result) + after.cached_value(key) - query_heavy(key, before_result) - cached_value(key);
+			if (abs(change) >= threshold) {
+				HeavyChange<ID_TYPE> item = {key, interval(key, before_result), after.interval(key, after_result), change};
+				result.push_back(item);
+			}
+		};
+		auto before_only = [&](const ID_TYPE& key, const tuple<bool, uint32_t, uint32_t>& before_result, const tuple<bool, uint32_t, uint32_t>& after_result) {
+			report(key, before_result, get<0>(after_result) ? after_result : after.stage1->query(key));
+		};
+		auto after_only = [&](const ID_TYPE& key, const tuple<bool, uint32_t, uint32_t>& after_result) {
+			auto before_result = stage1->query(key);
+			// otherwise already reported from this side
+			if (!get<0>(before_result)) {
+				report(key, before_result, after_result);
+			}
+		};
+		if (stage1->aligned(*after.stage1)) {
+			stage1->for_each_aligned(*after.stage1, before_only, after_only);
+		}
+		else {
+			stage1->for_each([&](const ID_TYPE& key, uint32_t value, int32_t error) {
+				before_only(key, make_tuple(true, value, (uint32_t)error), make_tuple(false, 0, 0));
+			});
+			after.stage1->for_each([&](const ID_TYPE& key, uint32_t value, int32_t error) {
+				after_only(key, make_tuple(true, value, (uint32_t)error));
+			});
+		}
+		unordered_set<ID_TYPE> decoded;
+		for (WeaveSketch* sketch: {this, &after}) {
+			if (sketch->invertible) {
+				for (auto& item: sketch->invertible->decode()) {
+					decoded.insert(item.first);
+				}
+			}
+		}
+		for (const ID_TYPE& key: decoded) {
+			auto before_result = stage1->query(key), after_result = after.stage1->query(key);
+			if (!get<0>(before_result) && !get<0>(after_result)) {
+				report(key, before_result, after_result);
+			}
+		}
+		return result;
+	}
+
+	// HyperLogLog registers (2^precision bytes) fed from the first heavy-part
+	// bucket hash, so cardinality() needs no pass of its own.
+	void enable_cardinality(int precision = 12) {
+		delete hll;
+		hll = new HyperLogLog(precision);
+	}
+
+	// distinct keys inserted since enable_cardinality()
+	double cardinality() {
+		flush();
+		sync();
+		return hll ? hll->estimate() : 0;
+	}
+
+	// Shannon entropy (bits) of the flow sizes. Heavy cells count their keys
+	// since admission. A nonzero light counter is split evenly among the flows
+	// that linear counting (or the cardinality, when enabled) puts on it, and
+	// the light mass is scaled up to cover what earlier light stages held.
+	double entropy() {
+		flush();
+		sync();
+		if (!total_count) {
+			return 0;
+		}
+		double heavy_sum = 0, light_sum = 0, heavy_entropy = 0, light_entropy = 0;
+		uint32_t counters = 0, nonzero = 0, heavy_flows = 0;
+		stage1->for_each([&](const ID_TYPE& key, uint32_t value, int32_t error) {
+			if (value) {
+				heavy_flows++;
+				heavy_sum += value;
+				heavy_entropy += value * log2((double)value);
+			}
+		});
+		stage2->for_each_counter([&](int32_t value) {
+			counters++;
+			if (value > 0) {
+				nonzero++;
+				light_sum += value;
+				light_entropy += value * log2((double)value);
+			}
+		});
+		double n = total_count, sum = heavy_entropy;
+		if (light_sum > 0) {
+			double flows = -(double)counters * log((double)MAX(counters - nonzero, 1u) / counters);
+			if (hll) {
+				flows = MAX(flows, hll->estimate() - heavy_flows);
+			}
+			double share = MAX(1.0, flows / nonzero);
+			double scale = MAX(1.0, (n - heavy_sum) / light_sum);
+			sum += scale * light_entropy + scale * log2(scale / share) * light_sum;
+		}
+		return log2(n) - sum / n;
+	}
+
+	// sum of all inserted values
+	uint64_t total() const {
+		return total_count;
+	}
+
+	// Adaptive mode: the memory passed to the constructor becomes a budget
+	// shared by both parts instead of a fixed memory_ratio split. Every epoch
+	// heavy-path inserts, the heavy part's eviction rate (when its hit rate is
+	// below ADAPT_HIT_TARGET) is weighed against the share of light inserts
+	// that came within half of the current error, and the part under more
+	// pressure is doubled if the budget still allows: the heavy part by an
+	// expansion, the light part by widening its current stage, which keeps
+	// its counts and does not spend a stage of the error budget. Once the
+	// budget is used up, a part under ADAPT_TRANSFER_RATIO times the other's
+	// pressure gives up half its memory to it: the heavy part folds its
+	// buckets in half and evicts the keys that no longer fit into the light
+	// part; the light part folds a stage that was never widened, which keeps
+	// its counts exactly. Light expansions keep their own trigger and
+	// max_expansion_time; when the budget is used up the new stage has the
+	// old stage's size.
+	void enable_adaptive(uint32_t epoch = 1 << 16) {
+		if (light_thread.joinable()) {
+			throw std::invalid_argument("adaptive memory does not support pipelined mode");
+		}
+		adaptive = true;
+		adapt_epoch = epoch;
+	}
+
+	// Overload mode, for a capture loop that cannot keep up during bursts:
+	// instead of dropping whole batches, insert() keeps each packet with
+	// probability 2^-level and inserts it with its value times 2^level, so
+	// estimates stay unbiased. Every OVERLOAD_WINDOW calls the level goes up
+	// while the backlog from report_backlog() is above backlog_high and not
+	// shrinking, by as many steps as the backlog grew relative to what the
+	// window took off it, and down by one once the backlog falls under a
+	// quarter of backlog_high. The decision is per packet, not per key, so
+	// every flow is sampled alike. The level stops where 2^level reaches a
+	// quarter of the light counter range (4 for int8_t counters), so an
+	// evicted packet still fits a light counter, and the expansion thresholds
+	// are compared in the same 2^level units. Sampled-out packets still reach
+	// the cardinality estimator.
+	void enable_overload(uint64_t backlog_high) {
+		overload_high = backlog_high;
+		if (!overload_random) {
+			overload_random = new RandomPool(600);
+		}
+		overload_max_level = 0;
+		while (overload_max_level < OVERLOAD_MAX_LEVEL && (int64_t)4 << (overload_max_level + 1) <= stage2->counter_limit()) {
+			overload_max_level++;
+		}
+		overload_ops = 0;
+		overload_time = std::chrono::steady_clock::now();
+	}
+
+	// packets waiting in front of the sketch, from the thread that inserts
+	void report_backlog(uint64_t packets) {
+		overload_backlog = packets;
+	}
+
+	double sampling_rate() const {
+		return 1.0 / (1 << sampling_level);
+	}
+
+	// Cuckoo relocation in the heavy part (see HeavyPart::set_relocation):
+	// a key whose buckets are full displaces residents along a path of up
+	// to max_hops moves before it evicts one into the light part.
+	void enable_relocation(int max_hops = 2) {
+		sync();
+		stage1->set_relocation(max_hops);
+	}
+
+	// current share of the used memory held by the heavy part
+	double heavy_ratio() {
+		return 1.0 * stage1_size / (stage1_size + stage2_size);
+	}
+
+	// wait until the light thread has applied every handed-off eviction
+	void sync() {
+		if (!light_thread.joinable()) {
+			return;
+		}
+		while (light_processed.load(std::memory_order_acquire) != light_pushed) {
+			drain_results();
+			std::this_thread::yield();
+		}
+		drain_results();
+	}
+
+	double cache_hit_rate() {
+		return cache_hit + cache_miss ? 1.0 * cache_hit / (cache_hit + cache_miss) : 0;
+	}
+
+	// pulls key's heavy buckets toward the cache ahead of insert(key, ...)
+	void prefetch(const ID_TYPE& key) {
+		uint32_t h[HEAVY_ARRAY_NUM];
+		stage1->locate(key, h);
+		stage1->prefetch(h);
 	}
 
 	void insert(ID_TYPE key, int32_t value) {
-		int min_value = stage1->insert(key, value);
+		total_count += value;
+		if (overload_random) {
+			if (++overload_ops == OVERLOAD_WINDOW) {
+				control_overload();
+			}
+			if (sampling_level) {
+				if (overload_random->next() >> (64 - sampling_level)) {
+					if (hll) {
+						hll->insert_hash(::hash(key, 0));
+					}
+					sampled_out++;
+					return;
+				}
+				// weighted in 64 bits and saturated, so a large value cannot wrap
+				int64_t weighted = (int64_t)value * ((int64_t)1 << sampling_level);
+				value = (int32_t)MAX(MIN(weighted, (int64_t)INT32_MAX), (int64_t)INT32_MIN);
+			}
+		}
+		if (!cache_size) {
+			insert_heavy(key, value);
+			return;
+		}
+		CacheEntry& entry = cache[::hash(key, 200) & (cache_size - 1)];
+		if (entry.value && entry.key == key) {
+			entry.value += value;
+			cache_hit++;
+			return;
+		}
+		cache_miss++;
+		if (entry.value) {
+			insert_heavy(entry.key, entry.value);
+		}
+		entry.key = key;
+		entry.value = value;
+	}
+
+	int32_t query(ID_TYPE key) {
+		sync();
+		return query_heavy(key, stage1->query(key)) + cached_value(key);
+	}
+
+	// Lower bound, estimate and upper bound of key's count. A heavy cell
+	// counts its key exactly since admission; what came before lives in the
+	// light part. The CM minimum of the current light stage bounds the key's
+	// share of that stage, and the largest counter of each stage discarded
+	// by a light expansion bounds its share of that one. Both hold only
+	// while no counter wrapped, which every light insert checks; after that
+	// the upper bound is INT32_MAX.
+	// Once overload mode has sampled, both bounds are widened by three
+	// standard deviations of the sampling error at the coarsest rate used.
+	QueryInterval query_interval(ID_TYPE key) {
+		sync();
+		return interval(key, stage1->query(key));
+	}
+
+	// Batched queries hash a group of keys first and prefetch their heavy
+	// buckets, so the bucket misses of the group overlap.
+	void query_batch(const ID_TYPE* keys, int n, int32_t* out) {
+		sync();
+		uint32_t h[QUERY_BATCH][HEAVY_ARRAY_NUM];
+		for (int begin = 0; begin < n; begin += QUERY_BATCH) {
+			int end = MIN(n, begin + QUERY_BATCH);
+			for (int k = begin; k < end; ++k) {
+				stage1->locate(keys[k], h[k - begin]);
+				stage1->prefetch(h[k - begin]);
+			}
+			for (int k = begin; k < end; ++k) {
+				out[k] = query_heavy(keys[k], stage1->query(keys[k], h[k - begin])) + cached_value(keys[k]);
+			}
+		}
+	}
+
+	void query_interval_batch(const ID_TYPE* keys, int n, QueryInterval* out) {
+		sync();
+		uint32_t h[QUERY_BATCH][HEAVY_ARRAY_NUM];
+		for (int begin = 0; begin < n; begin += QUERY_BATCH) {
+			int end = MIN(n, begin + QUERY_BATCH);
+			for (int k = begin; k < end; ++k) {
+				stage1->locate(keys[k], h[k - begin]);
+				stage1->prefetch(h[k - begin]);
+			}
+			for (int k = begin; k < end; ++k) {
+				out[k] = interval(keys[k], stage1->query(keys[k], h[k - begin]));
+			}
+		}
+	}
+
+	// Binary snapshot of the heavy and light parts and the error schedule,
+	// taken after pending cache entries and evictions are folded in. The
+	// front cache, pipeline, invertible table, HLL registers, relocation
+	// setting, adaptive and overload state are not part of it, except the
+	// coarsest sampling level, which the query intervals depend on.
+	void save(std::ostream& out) {
+		flush();
+		sync();
+		write_value(out, (uint32_t)SNAPSHOT_MAGIC);
+		write_value(out, (uint32_t)SNAPSHOT_VERSION);
+		write_value(out, (uint32_t)sizeof(ID_TYPE));
+		int32_t field[14] = {max_expansion_time, max_error, current_error, total_error, stage1_expansion_time, stage2_expansion_time,
+			stage1_insertion_failure, stage1_size, stage2_size, memory_budget, max_sampling_level,
+			(int32_t)MIN((int64_t)light_peak, (int64_t)INT32_MAX), (int32_t)MIN((int64_t)light_discarded, (int64_t)INT32_MAX), !light_bounded()};
+		write_array(out, field, 14);
+		write_value(out, total_count);
+		stage1->save(out);
+		stage2->save(out);
+	}
+
+	// Replaces the contents with a snapshot from save(); works on a
+	// default-constructed sketch too, and reads version 1 and 2 snapshots,
+	// which predate overload mode and the light-part bound tracking (their
+	// intervals have no upper bound). False if the snapshot is truncated,
+	// was written for another key type, or has parts larger than its memory
+	// budget or than a constructor accepts; the contents are unusable then.
+	bool load(std::istream& in) {
+		sync();
+		const int field_num[4] = {0, 10, 11, 14};
+		uint32_t magic, version, key_size;
+		int32_t field[14] = {};
+		if (!read_value(in, magic) || !read_value(in, version) || !read_value(in, key_size) || magic != SNAPSHOT_MAGIC
+			|| version < 1 || version > SNAPSHOT_VERSION || key_size != sizeof(ID_TYPE)
+			|| !read_array(in, field, field_num[version]) || !read_value(in, total_count)) {
+			return false;
+		}
+		max_expansion_time = field[0];
+		max_error = field[1];
+		current_error = field[2];
+		total_error = field[3];
+		stage1_expansion_time = field[4];
+		stage2_expansion_time = field[5];
+		stage1_insertion_failure = field[6];
+		stage1_size = field[7];
+		stage2_size = field[8];
+		memory_budget = field[9];
+		max_sampling_level = field[10];
+		light_peak = field[11];
+		light_discarded = field[12];
+		light_unbounded = version < 3 || field[13];
+		// memory * 1024 must fit an int, as in the constructors
+		if (stage1_size < 0 || stage2_size < 0 || memory_budget > INT32_MAX / 1024 || stage1_size + stage2_size > memory_budget) {
+			return false;
+		}
+		if (!stage1) {
+			stage1 = new HeavyPart<ID_TYPE>(0);
+			stage2 = new LightPart<ID_TYPE, DATA_TYPE>(0, 1);
+		}
+		try {
+			return stage1->load(in, stage1_size) && stage2->load(in, stage2_size);
+		}
+		catch (const std::bad_alloc&) {
+			return false;
+		}
+	}
+
+	// O(1), and safe to call from another thread while this one inserts:
+	// every field is a relaxed read of a counter kept on the insert path
+	WeaveSketchStats stats() const {
+		WeaveSketchStats result;
+		result.inserted = total_count;
+		result.heavy_cells = stage1->capacity();
+		result.heavy_used = stage1->used();
+		result.evictions = evictions;
+		result.light_inserts = light_inserts;
+		result.light_saturated = light_saturated;
+		result.heavy_occupancy = result.heavy_cells ? 1.0 * result.heavy_used / result.heavy_cells : 0;
+		result.light_saturation = result.light_inserts ? 1.0 * result.light_saturated / result.light_inserts : 0;
+		result.heavy_expansions = stage1_expansion_time;
+		result.light_expansions = stage2_expansion_time;
+		result.heavy_insertion_failures = stage1_insertion_failure;
+		result.current_error = current_error.load(std::memory_order_relaxed);
+		result.total_error = total_error;
+		result.max_error = max_error;
+		result.heavy_memory = stage1_size;
+		result.light_memory = stage2_size;
+		result.sampling_level = sampling_level;
+		result.sampling_rate = 1.0 / (1 << result.sampling_level);
+		result.max_sampling_level = max_sampling_level;
+		result.sampled_out = sampled_out;
+		result.insert_rate = insert_rate;
+		for (int hops = 1; hops <= RELOCATION_MAX_HOPS; ++hops) {
+			result.relocations[hops - 1] = stage1->relocations(hops);
+		}
+		result.relocation_failures = stage1->relocation_failures();
+		return result;
+	}
+
+	int32_t calculate_memory() {
+		sync();
+        int stage1_memory = stage1->calculate_memory(), stage2_memory = stage2->calculate_memory();
+		int cache_memory = cache_size * sizeof(CacheEntry) / 1024;
+		int invertible_memory = invertible ? invertible->calculate_memory() : 0;
+		int hll_memory = hll ? hll->calculate_memory() : 0;
+		return stage1_memory + stage2_memory + cache_memory + invertible_memory + hll_memory;
+	}
+private:
+	struct CacheEntry {
+		ID_TYPE key;
+		int32_t value;
+	};
+
+	struct LightTask {
+		ID_TYPE key, replaced_key;
+		uint32_t replaced_value;
+	};
+
+	struct LightResult {
+		ID_TYPE key;
+		int32_t error;
+	};
+
+	void insert_heavy(ID_TYPE key, int32_t value) {
+		uint32_t h[HEAVY_ARRAY_NUM];
+		stage1->locate(key, h);
+		if (hll) {
+			hll->insert_hash(h[0]);
+		}
+		int min_value = stage1->insert(key, value, h);
+		if (adaptive && ++adapt_ops == adapt_epoch) {
+			rebalance();
+		}
 		if (min_value < 0) {
+			adapt_hits++;
 			return;
 		}
-		if (min_value * 4 > current_error) {
+		if (min_value * 4 > weighted_error() && !adaptive) {
 			stage1_insertion_failure++;
 			if(stage1_insertion_failure >= pow(4, stage1_expansion_time + 1) && stage1_expansion_time < max_expansion_time) {
-                // stage1 expansion
-				stage1->expansion();
-				stage1_expansion_time++;
+				heavy_expansion();
 				stage1_insertion_failure = 0;
 			}	
 		}
+		if (light_thread.joinable()) {
+			insert_pipelined(key, value);
+			return;
+		}
 		uint32_t error = stage2->query_error(key);
 		auto replaced_item = stage1->insert_with_replace(key, value, error);
 		ID_TYPE replaced_key = get<0>(replaced_item);
 		uint32_t replaced_value = get<1>(replaced_item);
 
 		uint32_t cm_upper_bound = stage2->query_upper_bound(key);
-		if (cm_upper_bound + replaced_value > current_error && stage2_expansion_time < max_expansion_time) {
-			// stage2 expansion
-			stage2->expansion();
-			current_error *= 2;
-			total_error += current_error;
-			stage2_expansion_time++;
+		int64_t threshold = weighted_error();
+		bool saturated = (cm_upper_bound + replaced_value) * 2 > threshold;
+		evictions += replaced_value > 0;
+		light_inserts++;
+		light_saturated += saturated;
+		if (adaptive) {
+			adapt_evictions += replaced_value > 0;
+			adapt_saturated += saturated;
+			adapt_light_inserts++;
+		}
+		if (cm_upper_bound + replaced_value > threshold && light_expandable()) {
+			light_expansion();
 		}
 		
-		stage2->insert(replaced_key, replaced_value);
+		int64_t peak = stage2->insert(replaced_key, replaced_value);
+		light_peak = MAX((int64_t)light_peak, peak);
+		if (invertible && replaced_value) {
+			invertible->insert(replaced_key, replaced_value);
+		}
 	}
 
-	int32_t query(ID_TYPE key) {
-		auto heavy_result = stage1->query(key);
+	void heavy_expansion() {
+		stage1->expansion();
+		stage1_expansion_time++;
+		stage1_size *= 2;
+	}
+
+	bool light_expandable() {
+		return stage2_expansion_time < max_expansion_time;
+	}
+
+	void light_expansion() {
+		// a key's share of the discarded stage is at most its largest counter
+		light_unbounded = !light_bounded();
+		light_discarded += light_peak;
+		light_peak = 0;
+		int size = !adaptive || stage1_size + 2 * stage2_size <= memory_budget ? 2 * stage2_size : (int)stage2_size;
+		stage2->expansion(size);
+		current_error.store(current_error * 2, std::memory_order_relaxed);
+		total_error += current_error;
+		stage2_expansion_time++;
+		stage2_size = size;
+	}
+
+	// current_error in the units of inserted values: a sampled packet weighs 2^level
+	int64_t weighted_error() const {
+		return (int64_t)current_error.load(std::memory_order_relaxed) << sampling_level;
+	}
+
+	// window boundary of overload mode
+	void control_overload() {
+		auto now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - overload_time).count();
+		insert_rate = seconds > 0 ? (uint64_t)(overload_ops / seconds) : 0;
+		overload_time = now;
+		int level = sampling_level;
+		if (overload_backlog > overload_high && overload_backlog >= overload_last_backlog) {
+			// packets that arrived over the window against the ones it took
+			double growth = 1.0 * (overload_ops + overload_backlog - overload_last_backlog) / overload_ops;
+			level = MIN(level + MAX(1, (int)ceil(log2(growth))), overload_max_level);
+		}
+		else if (overload_backlog < overload_high / 4 && level) {
+			level--;
+		}
+		sampling_level = level;
+		if (level > max_sampling_level) {
+			max_sampling_level = level;
+		}
+		overload_last_backlog = overload_backlog;
+		overload_ops = 0;
+	}
+
+	// epoch boundary of adaptive mode
+	void rebalance() {
+		double hit_rate = 1.0 * adapt_hits / adapt_ops;
+		double heavy_pressure = hit_rate < ADAPT_HIT_TARGET ? 1.0 * adapt_evictions / adapt_ops : 0;
+		double light_pressure = adapt_light_inserts ? 1.0 * adapt_saturated / adapt_light_inserts : 0;
+		// averaged over epochs so that one bursty epoch does not decide alone
+		adapt_heavy_pressure = (adapt_heavy_pressure + heavy_pressure) / 2;
+		adapt_light_pressure = (adapt_light_pressure + light_pressure) / 2;
+		bool heavy_fits = 2 * stage1_size + stage2_size <= memory_budget;
+		bool light_fits = stage1_size + 2 * stage2_size <= memory_budget;
+		if (heavy_fits && adapt_heavy_pressure > ADAPT_MIN_PRESSURE && (adapt_heavy_pressure >= adapt_light_pressure || !light_fits)) {
+			heavy_expansion();
+		}
+		else if (light_fits && adapt_light_pressure > ADAPT_MIN_PRESSURE) {
+			stage2->widen();
+			stage2_size *= 2;
+		}
+		else if (adapt_heavy_pressure > ADAPT_MIN_PRESSURE && adapt_heavy_pressure > ADAPT_TRANSFER_RATIO * adapt_light_pressure
+				&& stage2->narrowable() && 2 * stage1_size + stage2_size / 2 <= memory_budget) {
+			light_peak = MAX((int64_t)light_peak, stage2->narrow());
+			stage2_size = stage2_size / 2;
+			heavy_expansion();
+		}
+		else if (adapt_light_pressure > ADAPT_MIN_PRESSURE && adapt_light_pressure > ADAPT_TRANSFER_RATIO * adapt_heavy_pressure
+				&& stage1->shrinkable() && stage1_size % 2 == 0 && stage1_size / 2 + 2 * stage2_size <= memory_budget) {
+			stage1->shrink([&](const ID_TYPE& key, uint32_t value) {
+				evictions++;
+				light_peak = MAX((int64_t)light_peak, stage2->insert(key, value));
+				if (invertible) {
+					invertible->insert(key, value);
+				}
+			});
+			stage1_size = stage1_size / 2;
+			stage2->widen();
+			stage2_size *= 2;
+		}
+		adapt_ops = adapt_hits = adapt_evictions = adapt_saturated = adapt_light_inserts = 0;
+	}
+
+	void insert_pipelined(ID_TYPE key, int32_t value) {
+		// the error is filled in when the light thread answers
+		auto replaced_item = stage1->insert_with_replace(key, value, HEAVY_ERROR_PENDING);
+		LightTask task = {key, get<0>(replaced_item), get<1>(replaced_item)};
+		evictions += task.replaced_value > 0;
+		while (!light_tasks->push(task)) {
+			drain_results();
+		}
+		light_pushed++;
+		drain_results();
+	}
+
+	void drain_results() {
+		LightResult result;
+		while (light_results->pop(result)) {
+			stage1->set_error(result.key, result.error);
+		}
+	}
+
+	// light thread: same light-part steps as insert_heavy, in hand-off order
+	void light_loop() {
+		LightTask task;
+		while (true) {
+			if (!light_tasks->pop(task)) {
+				if (pipeline_stop.load(std::memory_order_acquire)) {
+					return;
+				}
+				std::this_thread::yield();
+				continue;
+			}
+			LightResult result = {task.key, stage2->query_error(task.key)};
+			uint32_t cm_upper_bound = stage2->query_upper_bound(task.key);
+			light_inserts++;
+			int64_t threshold = weighted_error();
+			light_saturated += (cm_upper_bound + task.replaced_value) * 2 > threshold;
+			if (cm_upper_bound + task.replaced_value > threshold && light_expandable()) {
+				light_expansion();
+			}
+			int64_t peak = stage2->insert(task.replaced_key, task.replaced_value);
+			light_peak = MAX((int64_t)light_peak, peak);
+			if (invertible && task.replaced_value) {
+				invertible->insert(task.replaced_key, task.replaced_value);
+			}
+			while (!light_results->push(result)) {
+				std::this_thread::yield();
+			}
+			light_processed.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	int32_t cached_value(const ID_TYPE& key) {
+		if (!cache_size) {
+			return 0;
+		}
+		CacheEntry& entry = cache[::hash(key, 200) & (cache_size - 1)];
+		return entry.value && entry.key == key ? entry.value : 0;
+	}
+
+	QueryInterval interval(ID_TYPE key, const tuple<bool, uint32_t, uint32_t>& heavy_result) {
+		int64_t light_upper = stage2->query_cm(key);
+		// no upper bound left once a counter of any stage may have wrapped
+		light_upper = !light_bounded() || light_upper < 0 ? INT32_MAX : light_upper + light_discarded;
+		int64_t lower = 0, estimate, upper = light_upper;
+		if (get<0>(heavy_result) && (int32_t)get<2>(heavy_result) == HEAVY_ERROR_PENDING) {
+			// what came before admission is not known yet
+			lower = estimate = get<1>(heavy_result);
+			upper = INT32_MAX;
+		}
+		else if (get<0>(heavy_result)) {
+			lower = get<1>(heavy_result);
+			estimate = lower + (int32_t)get<2>(heavy_result);
+			upper = lower + light_upper;
+		}
+		else {
+			estimate = stage2->query_error(key);
+		}
+		if (max_sampling_level) {
+			// a count n sampled at 2^-level has variance n * (2^level - 1)
+			double variance = (1 << max_sampling_level) - 1;
+			lower = MAX((int64_t)0, lower - (int64_t)(3 * sqrt(variance * lower)));
+			upper = MIN((int64_t)INT32_MAX, upper + (int64_t)(3 * sqrt(variance * upper) + 9 * variance));
+		}
+		int32_t cached = cached_value(key);
+		upper = MIN(upper, (int64_t)INT32_MAX - cached);
+		estimate = MAX(lower, MIN(estimate, upper));
+		QueryInterval result = {(int32_t)(lower + cached), (int32_t)(estimate + cached), (int32_t)(upper + cached)};
+		return result;
+	}
+
+	bool light_bounded() const {
+		return !light_unbounded && light_peak <= stage2->counter_limit() && light_discarded <= INT32_MAX;
+	}
+
+	int32_t query_heavy(ID_TYPE key, const tuple<bool, uint32_t, uint32_t>& heavy_result) {
 		bool flag = get<0>(heavy_result);
 		int32_t value = get<1>(heavy_result), error = get<2>(heavy_result);
 		if (flag) {
-			return value + error;
+			return error == HEAVY_ERROR_PENDING ? value : value + error;
 		}
 		else {
 			return stage2->query_error(key);
 		}
 	}
-	int32_t calculate_memory() {
-        int stage1_memory = stage1->calculate_memory(), stage2_memory = stage2->calculate_memory();
-		std::cout << "Stage1: " << stage1_memory << ", Stage2: " << stage2_memory << "\n";
-		return stage1_memory + stage2_memory;
-	}
-private:
-	HeavyPart<ID_TYPE>* stage1;
-	LightPart<ID_TYPE, int8_t>* stage2;
-    int stage1_expansion_time = 0, stage2_expansion_time = 0;
-	int stage1_insertion_failure = 0;
-	int max_expansion_time;
-	int current_error, total_error, max_error;
+
+	HeavyPart<ID_TYPE>* stage1 = NULL;
+	LightPart<ID_TYPE, DATA_TYPE>* stage2 = NULL;
+	InvertibleLightPart<ID_TYPE>* invertible = NULL;
+	HyperLogLog* hll = NULL;
+	StatCounter<uint64_t> total_count;
+	// read by stats() from any thread
+	StatCounter<int> stage1_expansion_time, stage2_expansion_time;
+	StatCounter<int> stage1_insertion_failure;
+	int max_expansion_time = 0;
+	// KB held by each part and, in adaptive mode, the total they may use
+	StatCounter<int> stage1_size, stage2_size;
+	int memory_budget = 0;
+	bool adaptive = false;
+	uint32_t adapt_epoch = 0;
+	uint32_t adapt_ops = 0, adapt_hits = 0, adapt_evictions = 0, adapt_saturated = 0, adapt_light_inserts = 0;
+	// running average of the epoch pressures
+	double adapt_heavy_pressure = 0, adapt_light_pressure = 0;
+	// current_error is also read by the heavy thread in pipelined mode
+	std::atomic<int> current_error{0};
+	StatCounter<int> total_error;
+	int max_error = 0;
+	StatCounter<uint64_t> evictions, light_inserts, light_saturated;
+	// largest CM counter of the current light stage as if nothing wrapped,
+	// the sum of it over the discarded stages, and whether any of those wrapped;
+	// the light thread writes them in pipelined mode
+	StatCounter<int64_t> light_peak, light_discarded;
+	StatCounter<bool> light_unbounded;
+	// overload mode is on while overload_random is set
+	RandomPool* overload_random = NULL;
+	uint64_t overload_high = 0, overload_backlog = 0, overload_last_backlog = 0;
+	uint32_t overload_ops = 0;
+	int overload_max_level = OVERLOAD_MAX_LEVEL;
+	std::chrono::steady_clock::time_point overload_time;
+	StatCounter<int> sampling_level, max_sampling_level;
+	StatCounter<uint64_t> sampled_out, insert_rate;
+	CacheEntry* cache = NULL;
+	uint32_t cache_size = 0;
+	uint64_t cache_hit = 0, cache_miss = 0;
+	std::thread light_thread;
+	SPSCRing<LightTask>* light_tasks = NULL;
+	SPSCRing<LightResult>* light_results = NULL;
+	uint64_t light_pushed = 0;
+	std::atomic<uint64_t> light_processed{0};
+	std::atomic<bool> pipeline_stop{false};
 };
 
 